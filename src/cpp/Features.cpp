@@ -83,16 +83,22 @@ std::istream& operator>>(std::istream& is, Feature& feature) {
 
 
 bool Feature::overlaps(const Feature& other) const {
+    return reference == other.reference && overlaps(other.start, other.end);
+}
+
+
+///
+/// Check for overlap with a span on the same reference.
+///
+bool Feature::overlaps(unsigned long long int other_start, unsigned long long int other_end) const {
     return
-        reference == other.reference && (
-            (
-                (start <= other.start && other.start < end) ||
-                (start < other.end && other.end < end)
-            ) ||
-            (
-                (other.start <= start && start < other.end) ||
-                (other.start < end && end < other.end)
-            )
+        (
+            (start <= other_start && other_start < end) ||
+            (start < other_end && other_end < end)
+        ) ||
+        (
+            (other_start <= start && start < other_end) ||
+            (other_start < end && end < other_end)
         );
 }
 
@@ -12,6 +12,20 @@
 #include "HTS.hpp"
 
 
+///
+/// Just where a read aligned: its reference ID and span. Unlike a
+/// Feature, making one for every read allocates nothing.
+///
+struct Interval {
+    int32_t tid = -1;
+    unsigned long long int start = 0;
+    unsigned long long int end = 0;
+
+    Interval(int32_t tid, unsigned long long int start, unsigned long long int end) : tid(tid), start(start), end(end) {}
+    Interval(const bam1_t *record) : tid(record->core.tid), start(record->core.pos), end(bam_endpos(record)) {}
+};
+
+
 class Feature {
 public:
     std::string reference = "";
@@ -27,6 +41,7 @@ public:
 
     bool is_reverse() const;
     bool overlaps(const Feature& other) const;
+    bool overlaps(unsigned long long int other_start, unsigned long long int other_end) const;
     unsigned long long int size() const;
 };
 
@@ -0,0 +1,159 @@
+//
+// Copyright 2015 Stephen Parker
+//
+// Licensed under Version 3 of the GPL or any later version
+//
+
+#ifndef FLAGS_HPP
+#define FLAGS_HPP
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+
+#include <htslib/sam.h>
+
+
+///
+/// The counters that depend only on a read's SAM flag, as bit
+/// positions in a flag's class.
+///
+enum FlagCounter {
+    FORWARD_COUNTER,
+    REVERSE_COUNTER,
+    SECONDARY_COUNTER,
+    SUPPLEMENTARY_COUNTER,
+    DUPLICATE_COUNTER,
+    FIRST_COUNTER,
+    SECOND_COUNTER,
+    FORWARD_MATE_COUNTER,
+    REVERSE_MATE_COUNTER,
+    PAIRED_COUNTER,
+    FLAG_COUNTER_COUNT
+};
+
+///
+/// Where a read lands in Metrics::add_alignment's classification, as
+/// far as its flag can say. Reads in the two paired categories still
+/// need their reference IDs, insert size and quality examined.
+///
+enum FlagCategory {
+    QC_FAILED_CATEGORY,
+    UNPAIRED_CATEGORY,
+    UNMAPPED_CATEGORY,
+    MATE_UNMAPPED_CATEGORY,
+    FF_CATEGORY,
+    RR_CATEGORY,
+    PROPERLY_PAIRED_CATEGORY,
+    IMPROPERLY_PAIRED_CATEGORY
+};
+
+const int FLAG_CATEGORY_SHIFT = 24;
+const uint32_t FLAG_COUNTERS_MASK = (1u << FLAG_CATEGORY_SHIFT) - 1;
+
+constexpr uint32_t flag_counters(uint32_t flag) {
+    return
+        (flag & BAM_FREVERSE ? 1u << REVERSE_COUNTER : 1u << FORWARD_COUNTER) |
+        (flag & BAM_FSECONDARY ? 1u << SECONDARY_COUNTER : 0) |
+        (flag & BAM_FSUPPLEMENTARY ? 1u << SUPPLEMENTARY_COUNTER : 0) |
+        (flag & BAM_FDUP ? 1u << DUPLICATE_COUNTER : 0) |
+        (flag & BAM_FREAD1 ? 1u << FIRST_COUNTER : 0) |
+        (flag & BAM_FREAD2 ? 1u << SECOND_COUNTER : 0) |
+        (flag & BAM_FMREVERSE ? 1u << REVERSE_MATE_COUNTER : 1u << FORWARD_MATE_COUNTER) |
+        (flag & BAM_FPAIRED ? 1u << PAIRED_COUNTER : 0);
+}
+
+//
+// This follows the order of the checks in add_alignment. An RF read
+// has to have one mate on each strand, so the FF and RR categories
+// can be settled before the RF check, which needs the insert size.
+//
+constexpr uint32_t flag_category(uint32_t flag) {
+    return
+        flag & BAM_FQCFAIL ? QC_FAILED_CATEGORY :
+        !(flag & BAM_FPAIRED) ? UNPAIRED_CATEGORY :
+        flag & BAM_FUNMAP ? UNMAPPED_CATEGORY :
+        flag & BAM_FMUNMAP ? MATE_UNMAPPED_CATEGORY :
+        !(flag & BAM_FREVERSE) && !(flag & BAM_FMREVERSE) ? FF_CATEGORY :
+        (flag & BAM_FREVERSE) && (flag & BAM_FMREVERSE) ? RR_CATEGORY :
+        flag & BAM_FPROPER_PAIR ? PROPERLY_PAIRED_CATEGORY :
+        IMPROPERLY_PAIRED_CATEGORY;
+}
+
+constexpr uint32_t flag_class(uint32_t flag) {
+    return flag_counters(flag) | flag_category(flag) << FLAG_CATEGORY_SHIFT;
+}
+
+//
+// C++11 has no std::index_sequence. This one is built by halves, so
+// that the template recursion is only logarithmically deep.
+//
+template <size_t... I>
+struct IndexSequence {
+    typedef IndexSequence type;
+};
+
+template <typename First, typename Second>
+struct ConcatenatedIndexSequences;
+
+template <size_t... I, size_t... J>
+struct ConcatenatedIndexSequences<IndexSequence<I...>, IndexSequence<J...>> : IndexSequence<I..., (sizeof...(I) + J)...> {};
+
+template <size_t N>
+struct MakeIndexSequence : ConcatenatedIndexSequences<typename MakeIndexSequence<N / 2>::type, typename MakeIndexSequence<N - N / 2>::type> {};
+
+template <>
+struct MakeIndexSequence<0> : IndexSequence<> {};
+
+template <>
+struct MakeIndexSequence<1> : IndexSequence<0> {};
+
+template <typename Flags>
+struct FlagClassTable;
+
+template <size_t... Flags>
+struct FlagClassTable<IndexSequence<Flags...>> {
+    static constexpr uint32_t classes[sizeof...(Flags)] = {flag_class(Flags)...};
+};
+
+template <size_t... Flags>
+constexpr uint32_t FlagClassTable<IndexSequence<Flags...>>::classes[sizeof...(Flags)];
+
+///
+/// The class of every 12-bit SAM flag, computed at compile time.
+///
+typedef FlagClassTable<MakeIndexSequence<4096>::type> FlagClasses;
+
+inline uint32_t classify_flag(uint16_t flag) {
+    return FlagClasses::classes[flag & 0xfff];
+}
+
+inline FlagCategory flag_class_category(uint32_t flag_class) {
+    return static_cast<FlagCategory>(flag_class >> FLAG_CATEGORY_SHIFT);
+}
+
+///
+/// Add up the flag counters of a run of flags. Each block of 64 flags
+/// is turned into one 64-bit plane per counter, with a bit set for
+/// each flag that increments it, and each plane is then counted at
+/// once.
+///
+inline void count_flag_counters(const uint16_t* flags, size_t count, unsigned long long int (&totals)[FLAG_COUNTER_COUNT]) {
+    for (size_t block = 0; block < count; block += 64) {
+        size_t block_size = count - block < 64 ? count - block : 64;
+
+        uint64_t planes[FLAG_COUNTER_COUNT] = {};
+        for (size_t i = 0; i < block_size; i++) {
+            uint32_t counters = classify_flag(flags[block + i]);
+            for (size_t counter = 0; counter < FLAG_COUNTER_COUNT; counter++) {
+                planes[counter] |= (uint64_t)((counters >> counter) & 1) << i;
+            }
+        }
+
+        for (size_t counter = 0; counter < FLAG_COUNTER_COUNT; counter++) {
+            totals[counter] += std::bitset<64>(planes[counter]).count();
+        }
+    }
+}
+
+#endif  // FLAGS_HPP
@@ -1,4 +1,6 @@
 #include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <string>
 
@@ -45,3 +47,320 @@ sam_header parse_sam_header(const std::string &header_text) {
 
     return header;
 }
+
+
+bool is_coordinate_sorted(sam_header& header) {
+    return header.count("HD") > 0 && !header["HD"].empty() && header["HD"][0]["SO"] == "coordinate";
+}
+
+
+bool is_query_grouped(sam_header& header) {
+    return header.count("HD") > 0 && !header["HD"].empty() && (header["HD"][0]["SO"] == "queryname" || header["HD"][0]["GO"] == "query");
+}
+
+
+void get_string_tags(const bam1_t* record, const char* first_tag, const char** first_value, const char* second_tag, const char** second_value) {
+    *first_value = nullptr;
+    *second_value = nullptr;
+
+    const uint8_t* aux = bam_get_aux(record);
+    const uint8_t* end = aux + bam_get_l_aux(record);
+
+    while (aux + 3 <= end && !(*first_value && *second_value)) {
+        const uint8_t* value = aux + 3;
+        size_t size = 0;
+
+        switch (aux[2]) {
+        case 'A': case 'c': case 'C':
+            size = 1;
+            break;
+        case 's': case 'S':
+            size = 2;
+            break;
+        case 'i': case 'I': case 'f':
+            size = 4;
+            break;
+        case 'd':
+            size = 8;
+            break;
+        case 'Z': case 'H': {
+            const uint8_t* terminator = (const uint8_t*)memchr(value, '\0', end - value);
+            if (!terminator) {
+                return;
+            }
+            // like bam_aux_get, take the first occurrence of a tag
+            if (!*first_value && aux[0] == first_tag[0] && aux[1] == first_tag[1]) {
+                *first_value = (const char*)value;
+            }
+            if (!*second_value && aux[0] == second_tag[0] && aux[1] == second_tag[1]) {
+                *second_value = (const char*)value;
+            }
+            size = terminator - value + 1;
+            break;
+        }
+        case 'B': {
+            if (value + 5 > end) {
+                return;
+            }
+            uint32_t count = 0;
+            memcpy(&count, value + 1, 4);
+            size_t element_size = 0;
+            switch (value[0]) {
+            case 'c': case 'C': element_size = 1; break;
+            case 's': case 'S': element_size = 2; break;
+            case 'i': case 'I': case 'f': element_size = 4; break;
+            default: return;
+            }
+            size = 5 + (size_t)count * element_size;
+            break;
+        }
+        default:
+            // anything else means the aux data is corrupt
+            return;
+        }
+
+        aux = value + size;
+    }
+}
+
+
+uint64_t coordinate_sort_key(int32_t tid, int64_t pos) {
+    return ((uint64_t)(uint32_t)tid << 32) | (uint32_t)(pos + 1);
+}
+
+
+uint64_t hash_qname(const bam1_t* record) {
+    uint64_t hash = 14695981039346656037ULL;  // FNV-1a offset basis
+    for (const char* c = bam_get_qname(record); *c; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;  // FNV-1a prime
+    }
+    return hash;
+}
+
+
+int read_bam_record(BGZF* fp, bam1_t* record) {
+    bam1_core_t* core = &record->core;
+    int32_t block_length;
+    uint32_t fields[8];
+
+    ssize_t result = bgzf_read(fp, &block_length, 4);
+    if (result != 4) {
+        return result == 0 ? -1 : -2;
+    }
+
+    if (block_length < 32 || bgzf_read(fp, fields, 32) != 32) {
+        return -3;
+    }
+
+    core->tid = fields[0];
+    core->pos = (int32_t)fields[1];
+    core->bin = fields[2] >> 16;
+    core->qual = fields[2] >> 8 & 0xff;
+    core->l_qname = fields[2] & 0xff;
+    core->l_extranul = core->l_qname % 4 ? 4 - core->l_qname % 4 : 0;
+    core->flag = fields[3] >> 16;
+    core->n_cigar = fields[3] & 0xffff;
+    core->l_qseq = fields[4];
+    core->mtid = fields[5];
+    core->mpos = (int32_t)fields[6];
+    core->isize = (int32_t)fields[7];
+
+    // the query name is padded with NULs so the CIGAR after it is aligned
+    uint32_t l_data = block_length - 32 + core->l_extranul;
+    if (core->l_qname == 0 || core->l_qname + core->l_extranul > 255 || l_data < (uint32_t)core->l_qname + core->l_extranul) {
+        return -4;
+    }
+
+    // the CIGAR, sequence and qualities must fit in what's left, or
+    // anything reading them would run off the end of the data
+    if (core->l_qseq < 0 || ((uint64_t)core->n_cigar << 2) + core->l_qname + core->l_extranul + (((uint64_t)core->l_qseq + 1) >> 1) + core->l_qseq > l_data) {
+        return -4;
+    }
+
+    if (record->m_data < l_data) {
+        uint32_t m_data = l_data;
+        m_data--;
+        m_data |= m_data >> 1;
+        m_data |= m_data >> 2;
+        m_data |= m_data >> 4;
+        m_data |= m_data >> 8;
+        m_data |= m_data >> 16;
+        m_data++;
+
+        uint8_t* data = (uint8_t*)realloc(record->data, m_data);
+        if (!data) {
+            return -4;
+        }
+        record->data = data;
+        record->m_data = m_data;
+    }
+    record->l_data = l_data;
+
+    if (bgzf_read(fp, record->data, core->l_qname) != core->l_qname) {
+        return -4;
+    }
+    memset(record->data + core->l_qname, 0, core->l_extranul);
+    core->l_qname += core->l_extranul;
+
+    ssize_t rest = l_data - core->l_qname;
+    if (bgzf_read(fp, record->data + core->l_qname, rest) != rest) {
+        return -4;
+    }
+
+    return 4 + block_length;
+}
+
+
+bool DuplicateMarker::Signature::operator==(const Signature& other) const {
+    return
+        library == other.library &&
+        tid == other.tid &&
+        pos == other.pos &&
+        mate_tid == other.mate_tid &&
+        mate_pos == other.mate_pos &&
+        fragment_length == other.fragment_length &&
+        reverse == other.reverse &&
+        mate_reverse == other.mate_reverse;
+}
+
+
+size_t DuplicateMarker::SignatureHash::operator()(const Signature& signature) const {
+    uint64_t hash = signature.library;
+    for (uint64_t part : {(uint64_t)(uint32_t)signature.tid, (uint64_t)signature.pos, (uint64_t)(uint32_t)signature.mate_tid, (uint64_t)signature.mate_pos, (uint64_t)signature.fragment_length, (uint64_t)signature.reverse << 1 | signature.mate_reverse}) {
+        hash = (hash ^ part) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+
+///
+/// Set or clear the record's duplicate flag, returning whether it's a
+/// duplicate. Records must be given in coordinate order; the library
+/// can be anything identifying the records that can duplicate each
+/// other.
+///
+bool DuplicateMarker::mark(bam1_t* record, uint64_t library) {
+    uint64_t key = coordinate_sort_key(record->core.tid, record->core.pos);
+
+    while (!expiry.empty() && expiry.top().key < key) {
+        kept.erase(expiry.top().signature);
+        expiry.pop();
+    }
+
+    record->core.flag &= ~BAM_FDUP;
+
+    if (IS_UNMAPPED(record) || !IS_PRIMARY(record)) {
+        return false;
+    }
+
+    Signature signature;
+    signature.library = library;
+    uint64_t last_key = key;
+
+    if (IS_PAIRED(record) && !IS_MATE_UNMAPPED(record)) {
+        uint64_t mate_key = coordinate_sort_key(record->core.mtid, record->core.mpos);
+        bool reverse = IS_REVERSE(record) != 0;
+        bool mate_reverse = IS_MATE_REVERSE(record) != 0;
+
+        // both mates have to come up with the same signature
+        bool leftmost = key < mate_key || (key == mate_key && !reverse);
+        signature.tid = leftmost ? record->core.tid : record->core.mtid;
+        signature.pos = leftmost ? record->core.pos : record->core.mpos;
+        signature.reverse = leftmost ? reverse : mate_reverse;
+        signature.mate_tid = leftmost ? record->core.mtid : record->core.tid;
+        signature.mate_reverse = leftmost ? mate_reverse : reverse;
+
+        if (record->core.tid == record->core.mtid && record->core.isize != 0) {
+            // the fragment length pins down the other mate's 5' end
+            signature.fragment_length = llabs(record->core.isize);
+            last_key = std::max(key, mate_key);
+            last_key = std::max(last_key, coordinate_sort_key(signature.tid, signature.pos + signature.fragment_length));
+        } else if (record->core.tid == record->core.mtid) {
+            signature.mate_pos = leftmost ? record->core.mpos : record->core.pos;
+            last_key = std::max(key, mate_key);
+        } else {
+            // Waiting for the other reference would hold every chimeric
+            // pair's signature for the rest of this one, so each
+            // reference's mates are marked on their own, and the
+            // signature is done with once the file moves past here.
+            signature.mate_pos = leftmost ? record->core.mpos : record->core.pos;
+        }
+    } else {
+        signature.tid = record->core.tid;
+        signature.reverse = IS_REVERSE(record) != 0;
+        signature.pos = signature.reverse ? bam_endpos(record) : record->core.pos;
+        last_key = coordinate_sort_key(signature.tid, signature.pos);
+    }
+
+    uint64_t qname_hash = hash_qname(record);
+    auto it = kept.find(signature);
+    if (it == kept.end()) {
+        kept[signature] = qname_hash;
+        expiry.push(Expiry{last_key, signature});
+        return false;
+    }
+
+    if (it->second == qname_hash) {
+        return false;
+    }
+
+    record->core.flag |= BAM_FDUP;
+    duplicates++;
+    return true;
+}
+
+
+AlignmentReaderPool::AlignmentReaderPool(const std::string& filename, const hts_idx_t* index) : filename(filename), index(index) {}
+
+
+AlignmentReaderPool::~AlignmentReaderPool() {
+    for (auto reader : readers) {
+        bam_destroy1(reader->record);
+        bam_hdr_destroy(reader->header);
+        if (reader->file) {
+            hts_close(reader->file);
+        }
+        delete reader;
+    }
+}
+
+
+AlignmentReader* AlignmentReaderPool::borrow() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!idle.empty()) {
+            AlignmentReader* reader = idle.back();
+            idle.pop_back();
+            return reader;
+        }
+    }
+
+    AlignmentReader* reader = new AlignmentReader();
+    reader->index = index;
+    reader->record = bam_init1();
+    {
+        // registered before opening, so the pool cleans up after failures
+        std::lock_guard<std::mutex> lock(mutex);
+        readers.push_back(reader);
+    }
+
+    if ((reader->file = sam_open(filename.c_str(), "r")) == nullptr) {
+        throw FileException("Could not open alignment file \"" + filename + "\".");
+    }
+
+    if ((reader->header = sam_hdr_read(reader->file)) == nullptr) {
+        throw FileException("Could not read a valid header from alignment file \"" + filename + "\".");
+    }
+
+    reader->first_record_offset = bgzf_tell(reader->file->fp.bgzf);
+
+    return reader;
+}
+
+
+void AlignmentReaderPool::give_back(AlignmentReader* reader) {
+    std::lock_guard<std::mutex> lock(mutex);
+    idle.push_back(reader);
+}
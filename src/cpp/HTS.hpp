@@ -8,12 +8,18 @@
 #define HTS_HPP
 
 #include <map>
+#include <mutex>
+#include <queue>
 #include <sstream>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <htslib/bgzf.h>
 #include <htslib/kstring.h>
 #include <htslib/sam.h>
+#include <htslib/thread_pool.h>
 
 #include "Exceptions.hpp"
 #include "Utils.hpp"
@@ -41,4 +47,139 @@ typedef std::map<std::string, std::vector<std::map<std::string, std::string>>> s
 std::string get_qname(const bam1_t* record);
 std::string record_to_string(const bam_hdr_t* header, const bam1_t* record);
 sam_header parse_sam_header(const std::string &header_text);
+bool is_coordinate_sorted(sam_header& header);
+bool is_query_grouped(sam_header& header);
+
+///
+/// Find the values of two string aux tags in one pass over a record's
+/// aux data. A tag that's missing, or isn't a string, is left null.
+///
+void get_string_tags(const bam1_t* record, const char* first_tag, const char** first_value, const char* second_tag, const char** second_value);
+
+///
+/// A record's place in a coordinate-sorted file as one number, the
+/// way samtools sort orders them: reference ID in the high 32 bits,
+/// position plus one in the low. Reads without a reference (tid -1)
+/// sort after everything else.
+///
+uint64_t coordinate_sort_key(int32_t tid, int64_t pos);
+
+///
+/// A hash of a record's query name, to tell mates apart without
+/// copying it.
+///
+uint64_t hash_qname(const bam1_t* record);
+
+///
+/// Read the next record from a BAM file's BGZF stream, as bam_read1
+/// would, but with only the fixed-size core decoded: the CIGAR isn't
+/// walked to recompute the bin or check it against the sequence
+/// length, and no CG tag is looked for, so bam_endpos and the aux
+/// tags are only decoded when asked for. The record is still checked
+/// to be long enough for its CIGAR, sequence and qualities. The stream
+/// must be little-endian.
+///
+/// Returns the number of bytes read, -1 at the end of the file, or
+/// less than -1 on error.
+///
+int read_bam_record(BGZF* fp, bam1_t* record);
+
+///
+/// Marks duplicates as a coordinate-sorted alignment file streams
+/// past, instead of needing a separate duplicate marking pass.
+///
+/// Pairs are duplicates when they come from the same library and
+/// their mates were aligned to the same places on the same strands:
+/// the leftmost mate's reference, position and strand, the other
+/// mate's reference and strand, and the fragment length, or for mates
+/// on different references, the other mate's position. Reads without
+/// a mapped mate are duplicates of others on the same strand with the
+/// same 5' end. The first fragment seen with each signature is kept,
+/// and both its mates are left unmarked; every other is marked. Mates
+/// on different references are the exception: the first mate seen
+/// with each signature on each reference is kept, so the two mates
+/// kept may come from different fragments.
+///
+/// Signatures are forgotten once the file has moved past the last
+/// place a mate with them could be, or for mates on different
+/// references, past the mate being marked, so only about a fragment's
+/// length of them is held at a time. Unmapped, secondary and
+/// supplementary records are never marked.
+///
+class DuplicateMarker {
+private:
+    struct Signature {
+        uint64_t library = 0;
+        int32_t tid = -1;
+        int64_t pos = -1;
+        int32_t mate_tid = -1;
+        int64_t mate_pos = -1;
+        int64_t fragment_length = 0;
+        bool reverse = false;
+        bool mate_reverse = false;
+
+        bool operator==(const Signature& other) const;
+    };
+
+    struct SignatureHash {
+        size_t operator()(const Signature& signature) const;
+    };
+
+    struct Expiry {
+        uint64_t key;
+        Signature signature;
+
+        bool operator>(const Expiry& other) const {
+            return key > other.key;
+        }
+    };
+
+    // the query name hash of the fragment kept for each signature
+    std::unordered_map<Signature, uint64_t, SignatureHash> kept = {};
+    std::priority_queue<Expiry, std::vector<Expiry>, std::greater<Expiry>> expiry = {};
+
+public:
+    unsigned long long int duplicates = 0;
+
+    bool mark(bam1_t* record, uint64_t library);
+};
+
+
+///
+/// An open alignment file, with its header and a record to read into,
+/// for reading parts of the file found through its index. The
+/// offset is where the records start, just after the header.
+///
+struct AlignmentReader {
+    samFile* file = nullptr;
+    bam_hdr_t* header = nullptr;
+    bam1_t* record = nullptr;
+    const hts_idx_t* index = nullptr;
+    int64_t first_record_offset = 0;
+};
+
+
+///
+/// Alignment readers on one file, opened as they're first needed and
+/// reused after, so threads reading parts of the file don't each open
+/// it and parse its header again for every part. They all share the
+/// file's index, which must outlive the pool. A borrowed reader may
+/// be anywhere in the file, so seek before reading.
+///
+class AlignmentReaderPool {
+private:
+    std::string filename;
+    const hts_idx_t* index;
+    std::mutex mutex;
+    std::vector<AlignmentReader*> idle = {};
+    std::vector<AlignmentReader*> readers = {};
+
+public:
+    AlignmentReaderPool(const std::string& filename, const hts_idx_t* index);
+    ~AlignmentReaderPool();
+
+    AlignmentReader* borrow();
+    void give_back(AlignmentReader* reader);
+};
+
 #endif
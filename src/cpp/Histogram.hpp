@@ -0,0 +1,76 @@
+//
+// Copyright 2015 Stephen Parker
+//
+// Licensed under Version 3 of the GPL or any later version
+//
+
+#ifndef HISTOGRAM_HPP
+#define HISTOGRAM_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+
+///
+/// Counts of the values 0 through Size - 1, with anything larger
+/// lumped together in an overflow bucket. Adding a value is just an
+/// increment. The buckets must be allocated before values are added,
+/// so a histogram that's never used, as when its metrics weren't
+/// requested, costs no more than an empty vector.
+///
+template <size_t Size>
+class Histogram {
+private:
+    std::vector<unsigned long long int> counts;
+
+public:
+    static const size_t size = Size;
+
+    void allocate() {
+        if (counts.empty()) {
+            counts.resize(Size + 1, 0);
+        }
+    }
+
+    void add(unsigned long long int value, unsigned long long int count = 1) {
+        counts[value < Size ? value : Size] += count;
+    }
+
+    /// The count in a bucket: that of a value below Size, or at Size,
+    /// the overflow bucket.
+    unsigned long long int operator[](size_t bucket) const {
+        return counts.empty() ? 0 : counts[bucket];
+    }
+
+    /// The count of all the values of Size or more.
+    unsigned long long int overflow() const {
+        return counts.empty() ? 0 : counts[Size];
+    }
+
+    void merge(const Histogram& other) {
+        if (other.counts.empty()) {
+            return;
+        }
+
+        allocate();
+        for (size_t i = 0; i <= Size; i++) {
+            counts[i] += other.counts[i];
+        }
+    }
+
+    /// Set the count in a bucket, as when restoring a saved histogram.
+    void set(size_t bucket, unsigned long long int count) {
+        allocate();
+        counts[bucket < Size ? bucket : Size] = count;
+    }
+
+    void clear() {
+        std::fill(counts.begin(), counts.end(), 0);
+    }
+};
+
+template <size_t Size>
+const size_t Histogram<Size>::size;
+
+#endif  // HISTOGRAM_HPP
@@ -1,4 +1,7 @@
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
+#include <queue>
 
 #include "IO.hpp"
 
@@ -78,3 +81,122 @@ boost::shared_ptr<boost::iostreams::filtering_ostream> mostream(const std::strin
     filtering_ostream->push(sink);
     return filtering_ostream;
 }
+
+
+NameValueSpill::NameValueSpill(size_t buffer_limit) : buffer_limit(std::max((size_t)1, buffer_limit)) {}
+
+
+NameValueSpill::~NameValueSpill() {
+    for (auto run : runs) {
+        fclose(run);
+    }
+}
+
+
+void NameValueSpill::add(const std::string& name, unsigned long long int value) {
+    buffer.push_back({name, value});
+    if (buffer.size() >= buffer_limit) {
+        write_run();
+    }
+}
+
+
+void NameValueSpill::sort_buffer() {
+    std::stable_sort(buffer.begin(), buffer.end(), [](const std::pair<std::string, unsigned long long int>& a, const std::pair<std::string, unsigned long long int>& b) {
+        return a.first < b.first;
+    });
+}
+
+
+//
+// Runs are written as the name's length, the name, then the value.
+//
+void NameValueSpill::write_run() {
+    FILE* run = std::tmpfile();
+    if (run == nullptr) {
+        throw FileException(std::string("Could not create a temporary file: ") + strerror(errno));
+    }
+    runs.push_back(run);
+
+    sort_buffer();
+    for (const auto& pair : buffer) {
+        uint32_t length = pair.first.size();
+        if (fwrite(&length, sizeof(length), 1, run) != 1 ||
+            fwrite(pair.first.data(), 1, length, run) != length ||
+            fwrite(&pair.second, sizeof(pair.second), 1, run) != 1) {
+            throw FileException(std::string("Could not write to a temporary file: ") + strerror(errno));
+        }
+    }
+    buffer.clear();
+
+    if (fflush(run) != 0 || fseek(run, 0, SEEK_SET) != 0) {
+        throw FileException(std::string("Could not rewind a temporary file: ") + strerror(errno));
+    }
+}
+
+
+static bool read_spilled_pair(FILE* run, std::pair<std::string, unsigned long long int>& pair) {
+    uint32_t length = 0;
+    if (fread(&length, sizeof(length), 1, run) != 1) {
+        return false;
+    }
+
+    pair.first.resize(length);
+    if ((length > 0 && fread(&pair.first[0], 1, length, run) != length) ||
+        fread(&pair.second, sizeof(pair.second), 1, run) != 1) {
+        throw FileException("A temporary file was truncated.");
+    }
+    return true;
+}
+
+
+///
+/// Visit every pair in order, then forget them.
+///
+void NameValueSpill::replay(const std::function<void(const std::string& name, unsigned long long int value)>& visit) {
+    sort_buffer();
+
+    // The next pair from each run, and then the buffer, which holds
+    // the latest pairs. Ties go to the earliest source, so pairs with
+    // the same name come out in the order they went in.
+    size_t source_count = runs.size() + 1;
+    std::vector<std::pair<std::string, unsigned long long int>> heads(source_count);
+    size_t buffer_position = 0;
+
+    auto advance = [&](size_t source) {
+        if (source < runs.size()) {
+            return read_spilled_pair(runs[source], heads[source]);
+        }
+        if (buffer_position < buffer.size()) {
+            heads[source] = buffer[buffer_position++];
+            return true;
+        }
+        return false;
+    };
+
+    auto later = [&](size_t a, size_t b) {
+        return heads[b].first < heads[a].first || (heads[a].first == heads[b].first && b < a);
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(later)> queue(later);
+
+    for (size_t source = 0; source < source_count; source++) {
+        if (advance(source)) {
+            queue.push(source);
+        }
+    }
+
+    while (!queue.empty()) {
+        size_t source = queue.top();
+        queue.pop();
+        visit(heads[source].first, heads[source].second);
+        if (advance(source)) {
+            queue.push(source);
+        }
+    }
+
+    for (auto run : runs) {
+        fclose(run);
+    }
+    runs.clear();
+    buffer.clear();
+}
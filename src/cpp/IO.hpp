@@ -2,8 +2,12 @@
 #define IO_HPP
 
 #include <cerrno>
+#include <cstdio>
 #include <cstring>
+#include <functional>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <boost/iostreams/device/file.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
@@ -36,4 +40,32 @@ boost::shared_ptr<boost::iostreams::filtering_istream> mistream(const std::strin
 boost::shared_ptr<boost::iostreams::filtering_ostream> mostream(const std::string& filename);
 
 
+///
+/// Collects more (name, value) pairs than should be kept in memory,
+/// and hands them back sorted by name, with pairs of the same name in
+/// the order they were added. Pairs are buffered, and when the buffer
+/// fills, it's sorted and written to a temporary file; the sorted
+/// runs are merged as they're read back.
+///
+class NameValueSpill {
+private:
+    size_t buffer_limit;
+    std::vector<std::pair<std::string, unsigned long long int>> buffer = {};
+    std::vector<FILE*> runs = {};
+
+    void sort_buffer();
+    void write_run();
+
+public:
+    explicit NameValueSpill(size_t buffer_limit = 1 << 18);
+    ~NameValueSpill();
+
+    NameValueSpill(const NameValueSpill&) = delete;
+    NameValueSpill& operator=(const NameValueSpill&) = delete;
+
+    void add(const std::string& name, unsigned long long int value);
+    void replay(const std::function<void(const std::string& name, unsigned long long int value)>& visit);
+};
+
+
 #endif // IO_HPP
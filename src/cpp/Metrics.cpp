@@ -4,13 +4,20 @@
 // Licensed under Version 3 of the GPL or any later version
 //
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <cmath>
 #include <cstdarg>
-#include <future>
+#include <cstdint>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
 
 #include <boost/chrono.hpp>
@@ -19,9 +26,52 @@
 #include "HTS.hpp"
 #include "IO.hpp"
 #include "Metrics.hpp"
+#include "Threads.hpp"
 #include "Utils.hpp"
 
 
+//
+// The optional metrics modules, by the names --metrics knows them by.
+//
+static const std::vector<std::pair<std::string, unsigned int>> metrics_modules_by_name = {
+    {"fragment-length", FRAGMENT_LENGTH_METRICS},
+    {"mapq", MAPQ_METRICS},
+    {"chromosomes", CHROMOSOME_METRICS},
+    {"peaks", PEAK_METRICS},
+    {"tss", TSS_METRICS},
+    {"improper", IMPROPER_METRICS}
+};
+
+
+unsigned int parse_metrics_modules(const std::string& names) {
+    unsigned int modules = 0;
+    for (const auto& name : split(names, ",")) {
+        if (name == "all") {
+            modules |= ALL_METRICS;
+            continue;
+        }
+
+        auto module = std::find_if(metrics_modules_by_name.begin(), metrics_modules_by_name.end(), [&name](const std::pair<std::string, unsigned int>& m) {return m.first == name;});
+        if (module == metrics_modules_by_name.end()) {
+            throw std::invalid_argument("Unknown metrics \"" + name + "\".");
+        }
+        modules |= module->second;
+    }
+    return modules;
+}
+
+
+std::vector<std::string> metrics_module_names(unsigned int modules) {
+    std::vector<std::string> names;
+    for (const auto& module : metrics_modules_by_name) {
+        if (modules & module.second) {
+            names.push_back(module.first);
+        }
+    }
+    return names;
+}
+
+
 MetricsCollector::MetricsCollector(const std::string& name,
                                    const std::string& organism,
                                    const std::string& nucleus_barcode_tag,
@@ -89,6 +139,25 @@ std::string MetricsCollector::configuration_string() const {
         << "Ignoring read groups: " << (ignore_read_groups ? "yes" : "no") << std::endl
         << "Is single nucleus: " << (is_single_nucleus ? "yes" : "no") << std::endl;
 
+    if (shard_count > 1) {
+        cs << "Shard: " << shard_index << " of " << shard_count << std::endl;
+    }
+
+    if (mark_duplicates) {
+        cs << "Marking duplicates: yes" << std::endl;
+    }
+
+    if (metrics_modules != ALL_METRICS) {
+        std::vector<std::string> names = metrics_module_names(metrics_modules);
+        std::stringstream modules;
+        std::copy(names.begin(), names.end(), std::ostream_iterator<std::string>(modules, " "));
+        cs << "Optional metrics: " << (names.empty() ? "none" : modules.str()) << std::endl;
+    }
+
+    if (log_problematic_reads && problematic_read_sample_size > 0) {
+        cs << "Problematic read sample size: " << problematic_read_sample_size << std::endl;
+    }
+
     if (!tss_filename.empty()) {
         cs << "TSS extension: " << tss_extension << std::endl;
     }
@@ -207,14 +276,13 @@ void MetricsCollector::load_autosomal_references() {
 }
 
 
+//
+// This only reads the reference lists, so it's safe to call from the
+// ingest worker threads.
+//
 bool MetricsCollector::is_autosomal(const std::string& reference_name) {
-    static std::unordered_map<std::string, bool> refcache;
-
-    if (refcache.count(reference_name) == 0) {
-        refcache[reference_name] = autosomal_references[organism].find(reference_name) != autosomal_references[organism].end();
-    }
-
-    return refcache.at(reference_name);
+    auto organism_references = autosomal_references.find(organism);
+    return organism_references != autosomal_references.end() && organism_references->second.count(reference_name) > 0;
 }
 
 
@@ -222,7 +290,35 @@ bool MetricsCollector::is_mitochondrial(const std::string& reference_name) {
     return mitochondrial_reference_name.compare(reference_name) == 0;
 }
 
-bool MetricsCollector::is_hqaa(const bam_hdr_t* header, const bam1_t* record) {
+
+bool MetricsCollector::is_autosomal_tid(int32_t tid) const {
+    return tid >= 0 && (size_t)tid < reference_kinds.size() && (reference_kinds[tid] & AUTOSOMAL_REFERENCE);
+}
+
+
+bool MetricsCollector::is_mitochondrial_tid(int32_t tid) const {
+    return tid >= 0 && (size_t)tid < reference_kinds.size() && (reference_kinds[tid] & MITOCHONDRIAL_REFERENCE);
+}
+
+
+//
+// Record the alignment file's references, and which are autosomal or
+// mitochondrial.
+//
+void MetricsCollector::classify_references(const std::vector<std::string>& names) {
+    reference_names = names;
+    reference_kinds.assign(names.size(), 0);
+    for (size_t tid = 0; tid < names.size(); tid++) {
+        if (is_mitochondrial(names[tid])) {
+            reference_kinds[tid] |= MITOCHONDRIAL_REFERENCE;
+        }
+        if (is_autosomal(names[tid])) {
+            reference_kinds[tid] |= AUTOSOMAL_REFERENCE;
+        }
+    }
+}
+
+bool MetricsCollector::is_hqaa(const bam_hdr_t* /* header */, const bam1_t* record) {
     bool hqaa = false;
 
     if (
@@ -235,8 +331,7 @@ bool MetricsCollector::is_hqaa(const bam_hdr_t* header, const bam1_t* record) {
         (record->core.qual >= 30) &&
         (record->core.tid >= 0)) {
 
-        std::string reference_name(header->target_name[record->core.tid]);
-        if (is_autosomal(reference_name)) {
+        if (is_autosomal_tid(record->core.tid)) {
             hqaa = true;
         }
     }
@@ -245,6 +340,72 @@ bool MetricsCollector::is_hqaa(const bam_hdr_t* header, const bam1_t* record) {
 }
 
 
+//
+// Start the HTSlib thread pool used to decompress alignment files,
+// with the given number of threads, if any.
+//
+void MetricsCollector::start_thread_pool(int size) {
+    if (size < 1 || thread_pool.pool) {
+        return;
+    }
+
+    if ((thread_pool.pool = hts_tpool_init(size)) == nullptr) {
+        std::cerr << "Could not create a pool of " << size << " threads; decompressing alignments with one thread." << std::endl;
+    } else {
+        thread_pool_size = size;
+    }
+}
+
+
+void MetricsCollector::stop_thread_pool() {
+    if (thread_pool.pool) {
+        hts_tpool_destroy(thread_pool.pool);
+        thread_pool.pool = nullptr;
+        thread_pool_size = 0;
+    }
+}
+
+
+void MetricsCollector::use_thread_pool(samFile* alignment_file) {
+    if (thread_pool.pool && alignment_file) {
+        hts_set_opt(alignment_file, HTS_OPT_THREAD_POOL, &thread_pool);
+    }
+}
+
+
+//
+// Have a CRAM file decode only the fields the metrics use. Without
+// sequences or qualities to decode, the reference is rarely needed,
+// but it's used when given.
+//
+void MetricsCollector::limit_cram_decoding(samFile* alignment_file) {
+    if (!reference_filename.empty() && hts_set_fai_filename(alignment_file, reference_filename.c_str()) != 0) {
+        throw FileException("Could not use reference file \"" + reference_filename + "\" for alignment file \"" + alignment_filename + "\".");
+    }
+
+    // problematic reads are logged, and marked alignments written, whole
+    if (log_problematic_reads || !marked_alignment_filename.empty()) {
+        return;
+    }
+
+    int required_fields = SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_RNEXT | SAM_PNEXT | SAM_TLEN;
+
+    if (is_single_nucleus) {
+        required_fields |= SAM_AUX;
+    } else if (!ignore_read_groups) {
+        required_fields |= SAM_RGAUX;
+    }
+
+    // the CIGAR is needed for alignments' end positions
+    if ((!peak_filename.empty() && (metrics_modules & PEAK_METRICS)) || mark_duplicates) {
+        required_fields |= SAM_CIGAR;
+    }
+
+    hts_set_opt(alignment_file, CRAM_OPT_REQUIRED_FIELDS, required_fields);
+    hts_set_opt(alignment_file, CRAM_OPT_DECODE_MD, 0);
+}
+
+
 //
 // Load transcription start sites for the organism
 //
@@ -280,6 +441,8 @@ void MetricsCollector::load_tss() {
         }
     }
 
+    total_tss = tss_tree.size();
+
     if (verbose) {
         duration = boost::chrono::high_resolution_clock::now() - start;
         tss_tree.print_reference_feature_counts();
@@ -288,6 +451,60 @@ void MetricsCollector::load_tss() {
 }
 
 
+//
+// Turn the loaded TSS into windows, extended on each side, for the
+// references in the alignment file.
+//
+void MetricsCollector::make_tss_windows(const bam_hdr_t* header) {
+    tss_windows.assign(header->n_targets, std::vector<TSSWindow>());
+    size_t window_count = 0;
+
+    for (auto reference : tss_tree.get_references_by_feature_count()) {
+        int32_t tid = bam_name2id(const_cast<bam_hdr_t*>(header), reference.c_str());
+        if (tid < 0) {
+            std::cerr << "Could not find TSS reference " << reference << " in your BAM file. Check that your TSS file's chromosome naming scheme matches your reference." << std::endl;
+            continue;
+        }
+
+        std::vector<TSSWindow>& windows = tss_windows[tid];
+        for (auto tss : tss_tree.get_reference_feature_collection(reference)->features) {
+            TSSWindow window;
+            window.start = (int64_t)tss.start - tss_extension;
+            window.end = (int64_t)tss.end + tss_extension;
+            window.reverse = tss.is_reverse();
+            windows.push_back(window);
+        }
+
+        std::sort(windows.begin(), windows.end(), [](const TSSWindow& a, const TSSWindow& b) {
+            return std::tie(a.start, a.end, a.reverse) < std::tie(b.start, b.end, b.reverse);
+        });
+
+        // coalesce identical windows, so fragments only visit them once
+        size_t coalesced = 0;
+        for (size_t i = 1; i < windows.size(); i++) {
+            TSSWindow& last = windows[coalesced];
+            if (windows[i].start == last.start && windows[i].end == last.end && windows[i].reverse == last.reverse) {
+                last.count += windows[i].count;
+            } else {
+                windows[++coalesced] = windows[i];
+            }
+        }
+        windows.resize(windows.empty() ? 0 : coalesced + 1);
+        window_count += windows.size();
+
+        int64_t reach = 0;
+        for (auto& window : windows) {
+            reach = std::max(reach, window.end);
+            window.reach = reach;
+        }
+    }
+
+    if (verbose) {
+        std::cout << "Measuring coverage of " << total_tss << " TSS in " << window_count << " distinct windows." << std::endl << std::endl;
+    }
+}
+
+
 ///
 /// Measure all the reads in a BAM file
 ///
@@ -306,11 +523,11 @@ void MetricsCollector::load_alignments() {
         throw FileException("Could not open alignment file \"" + alignment_filename + "\".");
     }
 
-    if (!tss_filename.empty()) {
-        if ((alignment_file_index = sam_index_load(alignment_file, alignment_filename.c_str())) == nullptr) {
-            throw FileException("Before TSS enrichment can be calculated, you must create an index file\nfor alignment file \"" + alignment_filename + "\" with \"samtools index " + alignment_filename + "\".");
-        }
+    if (hts_get_format(alignment_file)->format == cram) {
+        limit_cram_decoding(alignment_file);
+    }
 
+    if (!tss_filename.empty() && (metrics_modules & TSS_METRICS)) {
         load_tss();
     }
 
@@ -323,10 +540,51 @@ void MetricsCollector::load_alignments() {
         throw FileException("Could not read a valid header from alignment file \"" + alignment_filename +  "\".");
     }
 
+    classify_references(std::vector<std::string>(alignment_file_header->target_name, alignment_file_header->target_name + alignment_file_header->n_targets));
+
+    if (!tss_filename.empty() && (metrics_modules & TSS_METRICS)) {
+        make_tss_windows(alignment_file_header);
+    }
+
     std::string default_metrics_id = name.empty() ? basename(alignment_filename) : name;
+    choose_metrics_key_getter();
 
     try {
         sam_header header = parse_sam_header(alignment_file_header->text);
+        coordinate_sorted = is_coordinate_sorted(header);
+        query_grouped = !coordinate_sorted && is_query_grouped(header);
+
+        reading_lean = lean_bam_reading && hts_get_format(alignment_file)->format == bam && !alignment_file->fp.bgzf->is_be;
+        if (lean_bam_reading && !reading_lean) {
+            std::cout << "Lean BAM reading is only possible with little-endian BAM files; \"" << alignment_filename << "\" will be read normally." << std::endl;
+        }
+
+        // With more than one thread, an indexed, coordinate-sorted
+        // BAM file can be split into chunks measured independently
+        // and merged, and a shard can skip straight to its
+        // references. Problematic reads have to be logged, and
+        // duplicates marked, in file order, though, so those still
+        // need a single reader.
+        bool scan_in_chunks = false;
+        if ((thread_limit > 1 || shard_count > 1) && !log_problematic_reads && !mark_duplicates && hts_get_format(alignment_file)->format == bam && coordinate_sorted) {
+            if (alignment_file_index == nullptr) {
+                alignment_file_index = sam_index_load(alignment_file, alignment_filename.c_str());
+            }
+            scan_in_chunks = alignment_file_index != nullptr;
+        }
+
+        // Each chunk's reader decompresses its own blocks. A single
+        // reader handing records to workers gets an htslib pool of
+        // about half the threads besides its own, and the workers
+        // the rest, to stay within the limit.
+        if (!scan_in_chunks && thread_limit > 2) {
+            start_thread_pool((thread_limit - 1) / 2);
+            use_thread_pool(alignment_file);
+        }
+
+        if (mark_duplicates) {
+            start_marking_duplicates(alignment_file_header);
+        }
         if (!ignore_read_groups && header.count("RG") > 0 && !is_single_nucleus) {
             for (auto read_group : header["RG"]) {
                 std::string read_group_id = read_group["ID"];
@@ -364,82 +622,43 @@ void MetricsCollector::load_alignments() {
 
         unsigned long long int total_reads = 0;
 
-        while (sam_read1(alignment_file, alignment_file_header, record) >= 0) {
-            Metrics* m;
-
-            uint8_t* rgaux = bam_aux_get(record, "RG");
-            uint8_t* bcaux = bam_aux_get(record, nucleus_barcode_tag.c_str());
-            std::string barcode = bcaux ? bam_aux2Z(bcaux) : "no_barcode";
-            std::string read_group_id = rgaux ? bam_aux2Z(rgaux) : default_metrics_id;
-            std::string metrics_id;
-
-            if (!ignore_read_groups && is_single_nucleus) {
-                metrics_id = read_group_id + "-" + barcode;
-            } else if (ignore_read_groups && is_single_nucleus) {
-                metrics_id = barcode;
-            } else if (!ignore_read_groups && !is_single_nucleus) {
-                metrics_id = read_group_id;
-            } else {
-                metrics_id = default_metrics_id;
-            }
-
-            // If running in single nucleus mode, barcodes
-            // are unknown ahead of time and Metrics must be created
-            // as new barcodes are encountered
-            //
-            // If not running in single nucleus mode,
-            // it can happen that records have RG tags that don't
-            // exist in the file header. If we're not ignoring
-            // read groups altogether, create new Metrics
-            // instances for these rapscallions.
-            try {
-                m = metrics.at(metrics_id);
-            } catch (std::out_of_range&) {
-                if (!ignore_read_groups && !is_single_nucleus) {
-                    std::cout << "Adding metrics for read group missing from file header: " << metrics_id << std::endl;
-                } else if (!ignore_read_groups && is_single_nucleus) {
-                    std::cout << "Adding metrics for read group and barcode: " << read_group_id << ", " << barcode << std::endl;
-                } else if (ignore_read_groups && is_single_nucleus) {
-                    std::cout << "Adding metrics for barcode: " << barcode << std::endl;
-                }
-                metrics[metrics_id] = new Metrics(this, metrics_id);
-                m = metrics[metrics_id];
-            }
+        if (scan_in_chunks) {
+            total_reads = collect_metrics_in_chunks(alignment_file_header, alignment_file_index, default_metrics_id);
+        } else if (thread_limit > 1) {
+            total_reads = collect_metrics_in_parallel(alignment_file, alignment_file_header, default_metrics_id);
+        } else {
+            total_reads = collect_metrics(alignment_file, alignment_file_header, default_metrics_id);
+        }
 
-            m->add_alignment(alignment_file_header, record);
+        stop_marking_duplicates(true);
 
-            total_reads++;
+        for (auto& it : metrics) {
+            it.second->count_pending_flags();
+            it.second->release_tss_mates();
+            it.second->settle_tss_coverage();
+        }
 
-            if (verbose && total_reads % 100000 == 0) {
-                duration = boost::chrono::high_resolution_clock::now() - start;
-                rate = (total_reads / duration.count());
-                std::cout << "Analyzed " << total_reads << " reads in " << duration << " (" << rate << " reads/second)." << std::endl;
-            }
+        // a shard's measurements are left raw, for ataqv merge to finish
+        if (shard_count <= 1) {
+            finalize();
         }
 
-        if (output_tss_coverage) {
-            calculate_tss_coverage();
-        } else {
-            calculate_tss_coverage_summary();
+        // the problematic reads waiting to be written still need the header
+        if (problematic_read_writer) {
+            problematic_read_writer->flush();
         }
 
-        for (auto& it : metrics) {
-            Metrics* m = it.second;
-            if (m->total_reads == 0) {
-                std::cout << "Dropping metrics " << m->name << " which has no reads." << std::endl;
-                metrics.erase(it.first);
-            } else {
-                m->make_aggregate_diagnoses();
-                m->peaks.determine_top_peaks();
-                m->calculate_tss_metrics();
-            }
+        if (log_problematic_reads && problematic_read_sample_size > 0) {
+            write_problematic_read_samples(make_problematic_read_sample_filename());
         }
 
         bam_destroy1(record);
         bam_hdr_destroy(alignment_file_header);
+        hts_idx_destroy(alignment_file_index);
         if (alignment_file) {
             hts_close(alignment_file);
         }
+        stop_thread_pool();
 
         if (verbose) {
             duration = boost::chrono::high_resolution_clock::now() - start;
@@ -447,93 +666,1725 @@ void MetricsCollector::load_alignments() {
             std::cout << "Analyzed " << total_reads << " reads in " << duration << " (" << rate << " reads/second)." << std::endl << std::endl;
         }
     } catch (FileException& e) {
+        if (problematic_read_writer) {
+            try {
+                problematic_read_writer->flush();
+            } catch (...) {
+                // the original error is the one worth reporting
+            }
+        }
+        stop_marking_duplicates(false);
         bam_destroy1(record);
         bam_hdr_destroy(alignment_file_header);
         hts_idx_destroy(alignment_file_index);
         if (alignment_file) {
             hts_close(alignment_file);
         }
+        stop_thread_pool();
         throw;
     }
 }
 
 
-Metrics::Metrics(MetricsCollector* collector, const std::string& name): collector(collector), name(name), peaks(), log_problematic_reads(collector->log_problematic_reads), less_redundant(collector->less_redundant) {
+///
+/// Once every read has been added, drop Metrics that never saw any,
+/// and calculate the metrics that depend on all the reads.
+///
+void MetricsCollector::finalize() {
+    // the main pass is over, and some Metrics may be about to go
+    metrics_keys.clear();
+    indexed_metrics.clear();
+
+    std::vector<Metrics*> remaining;
+    for (auto it = metrics.begin(); it != metrics.end();) {
+        Metrics* m = it->second;
+        if (m->total_reads == 0) {
+            std::cout << "Dropping metrics " << m->name << " which has no reads." << std::endl;
+            it = metrics.erase(it);
+            delete m;
+        } else {
+            remaining.push_back(m);
+            it++;
+        }
+    }
+
+    // With many read groups or nuclei, deriving each one's metrics
+    // takes a while, so the threads take blocks of them off a shared
+    // counter. Problematic reads are still logged in order, and the
+    // verbose progress reports printed in order, by one.
+    const size_t block_size = 64;
+    size_t worker_count = (log_problematic_reads || verbose) ? 1 : std::min((size_t)std::max(thread_limit, 1), (remaining.size() + block_size - 1) / block_size);
+    std::atomic<size_t> next_block(0);
+    std::vector<std::exception_ptr> worker_errors(worker_count);
 
-    if (log_problematic_reads) {
+    auto finalize_blocks = [&](size_t w) {
         try {
-            problematic_read_filename = make_metrics_filename(".problems");
+            for (size_t first = block_size * next_block++; first < remaining.size(); first = block_size * next_block++) {
+                for (size_t i = first; i < std::min(first + block_size, remaining.size()); i++) {
+                    remaining[i]->make_aggregate_diagnoses();
+                    remaining[i]->peaks.determine_top_peaks();
+                    remaining[i]->calculate_tss_metrics();
+                }
+            }
+        } catch (...) {
+            worker_errors[w] = std::current_exception();
+            next_block = remaining.size();
+        }
+    };
 
-            if (collector->verbose) {
-                std::cout << "Logging problematic reads to " << problematic_read_filename << "." << std::endl << std::endl;
+    if (worker_count <= 1) {
+        worker_errors.resize(1);
+        finalize_blocks(0);
+    } else {
+        std::vector<std::thread> workers;
+        for (size_t w = 0; w < worker_count; w++) {
+            workers.emplace_back(finalize_blocks, w);
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    for (auto& worker_error : worker_errors) {
+        if (worker_error) {
+            std::rethrow_exception(worker_error);
+        }
+    }
+}
+
+
+std::string MetricsCollector::make_problematic_read_sample_filename() const {
+    return (name.empty() ? basename(alignment_filename) : name) + shard_suffix() + ".problems.gz";
+}
+
+
+///
+/// Write every Metrics' sample of problematic reads to one
+/// BGZF-compressed file. For each Metrics and problem, a line starting
+/// with '#' gives the Metrics name, the problem and the exact number
+/// of reads that had it, followed by a line for each example, with
+/// the Metrics name, the problem and the read.
+///
+void MetricsCollector::write_problematic_read_samples(const std::string& filename) {
+    if (verbose) {
+        std::cout << "Writing samples of problematic reads to " << filename << "." << std::endl << std::endl;
+    }
+
+    BGZF* sample_file = bgzf_open(filename.c_str(), "w");
+    if (sample_file == nullptr) {
+        throw FileException("Could not open problematic read file " + filename + ".");
+    }
+
+    std::string lines;
+    bool written = true;
+    for (const auto& it : metrics) {
+        for (const auto& category : it.second->get_problematic_read_sample().list_categories()) {
+            lines += "#" + it.first + "\t" + category.problem + "\t" + std::to_string(category.count) + "\n";
+            for (const auto& example : category.examples) {
+                lines += it.first + "\t" + category.problem;
+                if (!example.text.empty()) {
+                    lines += "\t" + example.text;
+                }
+                lines += "\n";
+            }
+        }
+
+        if (bgzf_write(sample_file, lines.data(), lines.size()) < 0) {
+            written = false;
+            break;
+        }
+        lines.clear();
+    }
+
+    if (bgzf_close(sample_file) < 0 || !written) {
+        throw FileException("Could not write problematic read file " + filename + ".");
+    }
+}
+
+
+bool MetricsCollector::in_shard(int32_t tid) const {
+    if (shard_count <= 1) {
+        return true;
+    }
+
+    // reads with no reference go to the last shard
+    return tid < 0 ? shard_index == shard_count : tid % shard_count == shard_index - 1;
+}
+
+
+/// The part added to the names of the files written by a shard, so
+/// that shards run side by side don't overwrite each other's.
+std::string MetricsCollector::shard_suffix() const {
+    if (shard_count <= 1) {
+        return "";
+    }
+
+    return ".shard-" + std::to_string(shard_index) + "-of-" + std::to_string(shard_count);
+}
+
+
+/// The names of the organism's autosomal references, sorted.
+std::vector<std::string> MetricsCollector::organism_autosomal_references() const {
+    std::vector<std::string> names;
+    if (autosomal_references.count(organism) > 0) {
+        for (const auto& it : autosomal_references.at(organism)) {
+            names.push_back(it.first);
+        }
+        std::sort(names.begin(), names.end(), sort_strings_numerically);
+    }
+    return names;
+}
+
+
+///
+/// Save the collector's configuration and the raw measurements of
+/// all its Metrics, for combining with other shards' using
+/// merge_state.
+///
+nlohmann::json MetricsCollector::state_to_json() {
+    nlohmann::json metrics_json = nlohmann::json::array();
+    for (auto& m : metrics) {
+        metrics_json.push_back(m.second->state_to_json());
+    }
+
+    return {
+        {"ataqv_version", version_string()},
+        {"shard_index", shard_index},
+        {"shard_count", shard_count},
+        {"collector",
+         {
+             {"name", name},
+             {"organism", organism},
+             {"nucleus_barcode_tag", nucleus_barcode_tag},
+             {"description", description},
+             {"library_description", library_description},
+             {"url", url},
+             {"alignment_filename", alignment_filename},
+             {"references", reference_names},
+             {"autosomal_references", organism_autosomal_references()},
+             {"mitochondrial_reference_name", mitochondrial_reference_name},
+             {"tss_extension", tss_extension},
+             {"total_tss", total_tss},
+             {"ignore_read_groups", ignore_read_groups},
+             {"is_single_nucleus", is_single_nucleus},
+             {"output_tss_coverage", output_tss_coverage},
+             {"less_redundant", less_redundant},
+             {"metrics_modules", metrics_module_names(metrics_modules)}
+         }
+        },
+        {"metrics", metrics_json}
+    };
+}
+
+
+///
+/// Throw a FileException unless the JSON looks like a shard's state
+/// as saved by state_to_json, with everything merging it will read --
+/// the usual metrics output, for one, is a list of results instead.
+///
+void MetricsCollector::check_state(const nlohmann::json& state) {
+    static const std::vector<std::pair<std::string, nlohmann::json::value_t>> collector_fields = {
+        {"name", nlohmann::json::value_t::string},
+        {"organism", nlohmann::json::value_t::string},
+        {"nucleus_barcode_tag", nlohmann::json::value_t::string},
+        {"description", nlohmann::json::value_t::string},
+        {"library_description", nlohmann::json::value_t::string},
+        {"url", nlohmann::json::value_t::string},
+        {"alignment_filename", nlohmann::json::value_t::string},
+        {"references", nlohmann::json::value_t::array},
+        {"autosomal_references", nlohmann::json::value_t::array},
+        {"mitochondrial_reference_name", nlohmann::json::value_t::string},
+        {"tss_extension", nlohmann::json::value_t::number_integer},
+        {"total_tss", nlohmann::json::value_t::number_integer},
+        {"ignore_read_groups", nlohmann::json::value_t::boolean},
+        {"is_single_nucleus", nlohmann::json::value_t::boolean},
+        {"output_tss_coverage", nlohmann::json::value_t::boolean},
+        {"less_redundant", nlohmann::json::value_t::boolean},
+        {"metrics_modules", nlohmann::json::value_t::array}
+    };
+    static const std::vector<std::string> metrics_fields = {
+        "name", "library", "peaks_requested", "tss_requested", "tss_coverage_requested", "less_redundant", "counters",
+        "maximum_proper_pair_fragment_size", "unlikely_fragment_sizes", "fragment_length_counts", "chromosome_counts",
+        "mapq_counts", "tss_coverage", "peaks"
+    };
+
+    bool valid = state.is_object() &&
+        state.count("shard_index") > 0 && state["shard_index"].is_number_integer() &&
+        state.count("shard_count") > 0 && state["shard_count"].is_number_integer() &&
+        state.count("collector") > 0 && state["collector"].is_object() &&
+        state.count("metrics") > 0 && state["metrics"].is_array();
+
+    if (valid) {
+        const nlohmann::json& configuration = state["collector"];
+        for (const auto& field : collector_fields) {
+            // nonnegative integers are read back as unsigned
+            if (configuration.count(field.first) == 0 ||
+                !(field.second == nlohmann::json::value_t::number_integer ? configuration[field.first].is_number_integer() : configuration[field.first].type() == field.second)) {
+                valid = false;
+            }
+        }
+
+        for (const auto& metrics_state : state["metrics"]) {
+            if (!metrics_state.is_object()) {
+                valid = false;
+                break;
+            }
+            for (const auto& field : metrics_fields) {
+                if (metrics_state.count(field) == 0) {
+                    valid = false;
+                }
             }
+        }
+    }
+
+    if (!valid) {
+        throw FileException("it is not the state of a shard saved by ataqv --shard");
+    }
+}
+
+
+///
+/// Make a collector configured like the one that saved a shard's
+/// state, ready to merge the states of all the shards.
+///
+MetricsCollector MetricsCollector::from_state(const nlohmann::json& state, bool verbose) {
+    check_state(state);
+
+    const nlohmann::json& configuration = state["collector"];
+
+    MetricsCollector collector(
+        configuration["name"].get<std::string>(),
+        configuration["organism"].get<std::string>(),
+        configuration["nucleus_barcode_tag"].get<std::string>(),
+        configuration["description"].get<std::string>(),
+        configuration["library_description"].get<std::string>(),
+        configuration["url"].get<std::string>(),
+        configuration["alignment_filename"].get<std::string>(),
+        "",
+        configuration["mitochondrial_reference_name"].get<std::string>(),
+        "",
+        "",
+        configuration["tss_extension"].get<int>(),
+        verbose,
+        1,
+        configuration["ignore_read_groups"].get<bool>(),
+        configuration["is_single_nucleus"].get<bool>(),
+        false,
+        configuration["output_tss_coverage"].get<bool>(),
+        configuration["less_redundant"].get<bool>()
+    );
+
+    collector.autosomal_references[collector.organism] = {};
+    for (const auto& reference_name : configuration["autosomal_references"]) {
+        collector.autosomal_references[collector.organism][reference_name.get<std::string>()] = 1;
+    }
+    collector.classify_references(configuration["references"].get<std::vector<std::string>>());
+    collector.total_tss = configuration["total_tss"];
+
+    collector.metrics_modules = 0;
+    for (const auto& module_name : configuration["metrics_modules"]) {
+        collector.metrics_modules |= parse_metrics_modules(module_name.get<std::string>());
+    }
+
+    return collector;
+}
+
+
+///
+/// Add the Metrics saved in a shard's state to this collector's.
+///
+void MetricsCollector::merge_state(const nlohmann::json& state) {
+    check_state(state);
+
+    const nlohmann::json& configuration = state["collector"];
+    if (configuration["alignment_filename"] != alignment_filename ||
+        configuration["nucleus_barcode_tag"] != nucleus_barcode_tag ||
+        configuration["ignore_read_groups"] != ignore_read_groups ||
+        configuration["is_single_nucleus"] != is_single_nucleus ||
+        configuration["autosomal_references"].get<std::vector<std::string>>() != organism_autosomal_references() ||
+        configuration["organism"] != organism ||
+        configuration["mitochondrial_reference_name"] != mitochondrial_reference_name ||
+        configuration["tss_extension"] != tss_extension ||
+        configuration["total_tss"] != total_tss ||
+        configuration["metrics_modules"].get<std::vector<std::string>>() != metrics_module_names(metrics_modules) ||
+        configuration["references"].get<std::vector<std::string>>() != reference_names) {
+        throw FileException("The state for shard " + std::to_string(state["shard_index"].get<int>()) + " of " + std::to_string(state["shard_count"].get<int>()) + " was not collected with the same settings as the others.");
+    }
+
+    for (const auto& metrics_state : state["metrics"]) {
+        Metrics shard_metrics(this, metrics_state["name"]);
+        shard_metrics.load_state(metrics_state);
+
+        auto existing = metrics.find(shard_metrics.name);
+        if (existing == metrics.end()) {
+            metrics[shard_metrics.name] = new Metrics(shard_metrics);
+        } else {
+            existing->second->merge(shard_metrics);
+        }
+    }
+}
+
+
+void MetricsKey::add(const char* piece, size_t length) {
+    pieces[piece_count] = piece;
+    lengths[piece_count] = length;
+    piece_count++;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)piece[i];
+        hash *= 1099511628211ULL;  // FNV-1a prime
+    }
+}
+
+
+bool MetricsKey::matches(const std::string& id) const {
+    size_t offset = 0;
+    for (size_t i = 0; i < piece_count; i++) {
+        if (id.compare(offset, lengths[i], pieces[i], lengths[i]) != 0) {
+            return false;
+        }
+        offset += lengths[i];
+    }
+    return offset == id.size();
+}
+
+
+std::string MetricsKey::piece(size_t index) const {
+    return std::string(pieces[index], lengths[index]);
+}
+
+
+std::string MetricsKey::str() const {
+    std::string id;
+    for (size_t i = 0; i < piece_count; i++) {
+        id.append(pieces[i], lengths[i]);
+    }
+    return id;
+}
+
+
+//
+// Linear probing, starting at the slot picked by the hash's high
+// bits, mixed down so that keys differing only at the end spread out.
+//
+static size_t first_slot(uint64_t hash, size_t slot_count) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash & (slot_count - 1);
+}
+
+
+const size_t MetricsKeyTable::npos;
+
+
+size_t MetricsKeyTable::find(const MetricsKey& key) const {
+    if (slots.empty()) {
+        return npos;
+    }
+
+    for (size_t slot = first_slot(key.hash, slots.size()); slots[slot].index != npos; slot = (slot + 1) & (slots.size() - 1)) {
+        if (slots[slot].hash == key.hash && key.matches(ids[slots[slot].index])) {
+            return slots[slot].index;
+        }
+    }
+
+    return npos;
+}
+
+
+///
+/// Add a key that isn't in the table yet, returning its index.
+///
+size_t MetricsKeyTable::insert(const MetricsKey& key) {
+    // keep the table at most half full
+    if ((ids.size() + 1) * 2 > slots.size()) {
+        grow();
+    }
+
+    size_t slot = first_slot(key.hash, slots.size());
+    while (slots[slot].index != npos) {
+        slot = (slot + 1) & (slots.size() - 1);
+    }
+
+    slots[slot].hash = key.hash;
+    slots[slot].index = ids.size();
+    ids.push_back(key.str());
+
+    return slots[slot].index;
+}
+
+
+void MetricsKeyTable::grow() {
+    std::vector<Slot> old_slots(std::max((size_t)16, slots.size() * 2), Slot{0, npos});
+    old_slots.swap(slots);
+
+    for (const auto& old_slot : old_slots) {
+        if (old_slot.index != npos) {
+            size_t slot = first_slot(old_slot.hash, slots.size());
+            while (slots[slot].index != npos) {
+                slot = (slot + 1) & (slots.size() - 1);
+            }
+            slots[slot] = old_slot;
+        }
+    }
+}
+
+
+size_t MetricsKeyTable::size() const {
+    return ids.size();
+}
+
+
+const std::string& MetricsKeyTable::id(size_t index) const {
+    return ids.at(index);
+}
+
+
+void MetricsKeyTable::clear() {
+    slots.clear();
+    ids.clear();
+}
+
+
+//
+// Work out which Metrics a record belongs to, from its read group
+// and/or nucleus barcode, reading its aux data only once.
+//
+template <bool IgnoreReadGroups, bool SingleNucleus>
+MetricsKey MetricsCollector::get_metrics_key(const bam1_t* record, const std::string& default_metrics_id) const {
+    MetricsKey key;
+
+    if (IgnoreReadGroups && !SingleNucleus) {
+        key.add(default_metrics_id.c_str(), default_metrics_id.size());
+        return key;
+    }
+
+    const char* read_group_id = nullptr;
+    const char* barcode = nullptr;
+    get_string_tags(record, "RG", &read_group_id, SingleNucleus ? nucleus_barcode_tag.c_str() : "RG", &barcode);
+
+    if (!IgnoreReadGroups) {
+        if (read_group_id) {
+            key.add(read_group_id, strlen(read_group_id));
+        } else {
+            key.add(default_metrics_id.c_str(), default_metrics_id.size());
+        }
+
+        if (!SingleNucleus) {
+            return key;
+        }
+
+        key.add("-", 1);
+    }
+
+    if (barcode) {
+        key.add(barcode, strlen(barcode));
+    } else {
+        key.add("no_barcode", 10);
+    }
+
+    return key;
+}
+
+
+void MetricsCollector::choose_metrics_key_getter() {
+    if (ignore_read_groups) {
+        metrics_key_getter = is_single_nucleus ? &MetricsCollector::get_metrics_key<true, true> : &MetricsCollector::get_metrics_key<true, false>;
+    } else {
+        metrics_key_getter = is_single_nucleus ? &MetricsCollector::get_metrics_key<false, true> : &MetricsCollector::get_metrics_key<false, false>;
+    }
+}
+
+
+//
+// Find the dense index of the Metrics for a record's read group
+// and/or nucleus barcode, creating them if this is the first record
+// seen for them.
+//
+size_t MetricsCollector::get_metrics_index(const bam1_t* record, const std::string& default_metrics_id) {
+    MetricsKey key = (this->*metrics_key_getter)(record, default_metrics_id);
+
+    size_t index = metrics_keys.find(key);
+    if (index != MetricsKeyTable::npos) {
+        return index;
+    }
+
+    std::string metrics_id = key.str();
+    Metrics* m = nullptr;
+
+    auto existing = metrics.find(metrics_id);
+    if (existing != metrics.end()) {
+        m = existing->second;
+    } else {
+        // If running in single nucleus mode, barcodes
+        // are unknown ahead of time and Metrics must be created
+        // as new barcodes are encountered
+        //
+        // If not running in single nucleus mode,
+        // it can happen that records have RG tags that don't
+        // exist in the file header. If we're not ignoring
+        // read groups altogether, create new Metrics
+        // instances for these rapscallions.
+        if (!ignore_read_groups && !is_single_nucleus) {
+            std::cout << "Adding metrics for read group missing from file header: " << metrics_id << std::endl;
+        } else if (!ignore_read_groups && is_single_nucleus) {
+            std::cout << "Adding metrics for read group and barcode: " << key.piece(0) << ", " << key.piece(2) << std::endl;
+        } else if (ignore_read_groups && is_single_nucleus) {
+            std::cout << "Adding metrics for barcode: " << metrics_id << std::endl;
+        }
+
+        m = new Metrics(this, metrics_id);
+        metrics[metrics_id] = m;
+    }
+
+    indexed_metrics.push_back(m);
+    return metrics_keys.insert(key);
+}
+
+
+Metrics* MetricsCollector::get_metrics(const bam1_t* record, const std::string& default_metrics_id) {
+    return indexed_metrics[get_metrics_index(record, default_metrics_id)];
+}
+
+
+//
+// Read the next record, the lean way if we can, and otherwise with
+// htslib. The lean reader doesn't check references against the
+// header, so that's done here.
+//
+int MetricsCollector::read_alignment(samFile* alignment_file, bam_hdr_t* alignment_file_header, bam1_t* record) const {
+    if (!reading_lean) {
+        return sam_read1(alignment_file, alignment_file_header, record);
+    }
+
+    int result = read_bam_record(alignment_file->fp.bgzf, record);
+    if (result >= 0 && (record->core.tid >= alignment_file_header->n_targets || record->core.tid < -1 || record->core.mtid >= alignment_file_header->n_targets || record->core.mtid < -1)) {
+        throw FileException("Record " + get_qname(record) + " refers to a reference missing from the header of \"" + alignment_filename + "\".");
+    }
+    return result;
+}
+
+
+//
+// Mark or clear the record's duplicate flag, with its Metrics standing
+// for its library, and pass it on to the marked alignment file.
+//
+void MetricsCollector::mark_duplicate(const bam_hdr_t* alignment_file_header, bam1_t* record, size_t metrics_index) {
+    duplicate_marker->mark(record, metrics_index);
+
+    if (marked_alignment_file && sam_write1(marked_alignment_file, alignment_file_header, record) < 0) {
+        throw FileException("Could not write to marked alignment file \"" + marked_alignment_filename + "\".");
+    }
+}
+
+
+//
+// Start marking duplicates, and if requested, writing the marked
+// alignments.
+//
+void MetricsCollector::start_marking_duplicates(const bam_hdr_t* alignment_file_header) {
+    if (!coordinate_sorted) {
+        throw FileException("Duplicates can only be marked in a coordinate-sorted alignment file, which \"" + alignment_filename + "\" is not.");
+    }
+
+    duplicate_marker = std::make_shared<DuplicateMarker>();
+
+    if (!marked_alignment_filename.empty()) {
+        if ((marked_alignment_file = sam_open(marked_alignment_filename.c_str(), "wb")) == nullptr) {
+            throw FileException("Could not open marked alignment file \"" + marked_alignment_filename + "\".");
+        }
+        use_thread_pool(marked_alignment_file);
+
+        if (sam_hdr_write(marked_alignment_file, alignment_file_header) < 0) {
+            throw FileException("Could not write the header to marked alignment file \"" + marked_alignment_filename + "\".");
+        }
+    }
+}
+
+
+//
+// Close the marked alignment file, if it's open. Closing flushes the
+// last records, so failing is an error if the file was meant to be
+// complete.
+//
+void MetricsCollector::stop_marking_duplicates(bool complete) {
+    if (marked_alignment_file) {
+        int result = hts_close(marked_alignment_file);
+        marked_alignment_file = nullptr;
+        if (result < 0 && complete) {
+            throw FileException("Could not finish writing marked alignment file \"" + marked_alignment_filename + "\".");
+        }
+    }
+
+    if (duplicate_marker && verbose) {
+        std::cout << "Marked " << duplicate_marker->duplicates << " duplicate reads." << std::endl;
+    }
+}
+
+
+///
+/// Read every record in the alignment file and add it to its Metrics
+/// on this thread.
+///
+unsigned long long int MetricsCollector::collect_metrics(samFile* alignment_file, bam_hdr_t* alignment_file_header, const std::string& default_metrics_id) {
+    bam1_t *record = bam_init1();
+
+    boost::chrono::high_resolution_clock::time_point start = boost::chrono::high_resolution_clock::now();
+    boost::chrono::duration<double> duration;
+    double rate = 0.0;
+
+    // when verbose, split the time spent in the main pass between
+    // reading (and decompressing) records and measuring them
+    boost::chrono::high_resolution_clock::time_point step_start;
+    boost::chrono::duration<double> decode_duration(0);
+    boost::chrono::duration<double> metrics_duration(0);
+
+    unsigned long long int total_reads = 0;
+
+    try {
+        while (true) {
+            if (verbose) {
+                step_start = boost::chrono::high_resolution_clock::now();
+            }
+
+            if (read_alignment(alignment_file, alignment_file_header, record) < 0) {
+                break;
+            }
+
+            if (verbose) {
+                boost::chrono::high_resolution_clock::time_point now = boost::chrono::high_resolution_clock::now();
+                decode_duration += now - step_start;
+                step_start = now;
+            }
+
+            if (!in_shard(record->core.tid)) {
+                continue;
+            }
+
+            size_t index = get_metrics_index(record, default_metrics_id);
+            if (duplicate_marker) {
+                mark_duplicate(alignment_file_header, record, index);
+            }
+
+            indexed_metrics[index]->add_alignment(alignment_file_header, record);
+
+            total_reads++;
+
+            if (verbose) {
+                metrics_duration += boost::chrono::high_resolution_clock::now() - step_start;
+
+                if (total_reads % 100000 == 0) {
+                    duration = boost::chrono::high_resolution_clock::now() - start;
+                    rate = (total_reads / duration.count());
+                    std::cout << "Analyzed " << total_reads << " reads in " << duration << " (" << rate << " reads/second; " << decode_duration << " decoding, " << metrics_duration << " collecting metrics)." << std::endl;
+                }
+            }
+        }
+    } catch (...) {
+        bam_destroy1(record);
+        throw;
+    }
+
+    bam_destroy1(record);
+
+    if (verbose) {
+        std::cout << "Read " << total_reads << " reads: " << decode_duration << " decoding, " << metrics_duration << " collecting metrics." << std::endl;
+    }
+
+    return total_reads;
+}
+
+
+ProblematicReadWriter::Batch::Batch(size_t capacity) : reads(capacity) {
+    for (auto& read : reads) {
+        read.record = bam_init1();
+    }
+}
+
+
+ProblematicReadWriter::Batch::~Batch() {
+    for (auto& read : reads) {
+        bam_destroy1(read.record);
+    }
+}
+
+
+ProblematicReadWriter::ProblematicReadWriter(size_t batch_count, size_t batch_size) : free_batches(batch_count), full_batches(batch_count) {
+    for (size_t i = 0; i < batch_count; i++) {
+        batches.push_back(new Batch(batch_size));
+        free_batches.push(batches.back());
+    }
+
+    writer = std::thread(&ProblematicReadWriter::write_batches, this);
+}
+
+
+ProblematicReadWriter::~ProblematicReadWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (filling && filling->size > 0) {
+            full_batches.push(filling);
+        }
+        filling = nullptr;
+
+        // a null batch is the signal to stop
+        full_batches.push(nullptr);
+    }
+
+    writer.join();
+
+    for (auto& stream : written_streams) {
+        stream.second->flush();
+    }
+
+    for (auto batch : batches) {
+        delete batch;
+    }
+}
+
+
+//
+// Claim the next slot in the batch being filled, handing the batch
+// to the writer first if it's full. The caller holds the mutex.
+//
+ProblematicReadWriter::ProblematicRead& ProblematicReadWriter::next_read(const boost::shared_ptr<boost::iostreams::filtering_ostream>& stream, const std::string& problem) {
+    if (filling && filling->size == filling->reads.size()) {
+        full_batches.push(filling);
+        filling = nullptr;
+    }
+
+    if (!filling) {
+        filling = free_batches.pop();
+    }
+
+    // the slots' strings and records are reused, so once they've
+    // grown to fit, copying a read into one doesn't allocate
+    ProblematicRead& read = filling->reads[filling->size++];
+    read.stream = stream;
+    read.problem = problem;
+    return read;
+}
+
+
+void ProblematicReadWriter::add(const boost::shared_ptr<boost::iostreams::filtering_ostream>& stream, const std::string& problem, const bam_hdr_t* header, const bam1_t* record) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ProblematicRead& read = next_read(stream, problem);
+    read.text.clear();
+    read.header = header;
+    if (bam_copy1(read.record, record) == nullptr) {
+        filling->size--;
+        throw HTSException("Could not copy problematic read " + get_qname(record));
+    }
+}
+
+
+void ProblematicReadWriter::add(const boost::shared_ptr<boost::iostreams::filtering_ostream>& stream, const std::string& problem, const std::string& text) {
+    std::lock_guard<std::mutex> lock(mutex);
+    ProblematicRead& read = next_read(stream, problem);
+    read.text = text;
+    read.header = nullptr;
+}
+
+
+//
+// Wait until every read added so far has been written, and flush the
+// streams they went to. The headers of the reads added so far can be
+// freed after this.
+//
+void ProblematicReadWriter::flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (filling) {
+        if (filling->size > 0) {
+            full_batches.push(filling);
+        } else {
+            free_batches.push(filling);
+        }
+        filling = nullptr;
+    }
+
+    // the writer has caught up once every batch is free again
+    std::vector<Batch*> drained;
+    while (drained.size() < batches.size()) {
+        drained.push_back(free_batches.pop());
+    }
+    for (auto batch : drained) {
+        free_batches.push(batch);
+    }
+
+    for (auto& stream : written_streams) {
+        stream.second->flush();
+    }
+    written_streams.clear();
+
+    if (writer_error) {
+        std::exception_ptr error = writer_error;
+        writer_error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+
+void ProblematicReadWriter::write_batches() {
+    kstring_t ks = {0, 0, nullptr};
+
+    while (Batch* batch = full_batches.pop()) {
+        for (size_t i = 0; i < batch->size; i++) {
+            ProblematicRead& read = batch->reads[i];
+            if (!writer_error) {
+                try {
+                    written_streams.insert(std::make_pair(read.stream.get(), read.stream));
+
+                    *read.stream << read.problem;
+
+                    if (read.header) {
+                        if (sam_format1(read.header, read.record, &ks) < 0) {
+                            throw HTSException("Could not format record " + get_qname(read.record));
+                        }
+                        *read.stream << '\t';
+                        read.stream->write(ks.s, ks.l);
+                    } else if (!read.text.empty()) {
+                        *read.stream << '\t' << read.text;
+                    }
+
+                    *read.stream << '\n';
+                } catch (...) {
+                    // keep recycling batches so adding reads can't block
+                    writer_error = std::current_exception();
+                }
+            }
+            read.stream = nullptr;
+        }
+        batch->size = 0;
+        free_batches.push(batch);
+    }
+
+    free(ks.s);
+}
+
+
+ProblematicReadSample::ProblematicReadSample(size_t limit, uint64_t seed) : limit(limit), random_state(seed) {}
+
+
+//
+// splitmix64: small, fast, and good enough for picking examples,
+// which matters with a sample per nucleus barcode.
+//
+uint64_t ProblematicReadSample::next_random() {
+    uint64_t z = (random_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+
+///
+/// The problems seen, in the order they were first seen, each with
+/// its examples in the order they were added.
+///
+std::vector<ProblematicReadSample::Category> ProblematicReadSample::list_categories() const {
+    std::vector<Category> listed(categories);
+    for (auto& category : listed) {
+        std::sort(category.examples.begin(), category.examples.end(), [](const Example& a, const Example& b) {return a.sequence < b.sequence;});
+    }
+    return listed;
+}
+
+
+//
+// A batch of records headed for one ingest worker, each paired with
+// the Metrics it belongs to.
+//
+struct AlignmentBatch {
+    std::vector<bam1_t*> records;
+    std::vector<Metrics*> metrics;
+    size_t size = 0;
+
+    explicit AlignmentBatch(size_t capacity) : records(capacity), metrics(capacity) {
+        for (auto& record : records) {
+            record = bam_init1();
+        }
+    }
+
+    ~AlignmentBatch() {
+        for (auto& record : records) {
+            bam_destroy1(record);
+        }
+    }
+
+    bool full() const {
+        return size == records.size();
+    }
+};
+
+
+///
+/// Read the alignment file on this thread, handing batches of records
+/// to worker threads that add them to their Metrics. Each Metrics
+/// instance is owned by exactly one worker, chosen by hashing its
+/// name, so its records are still added in file order and its
+/// counters need no locking.
+///
+unsigned long long int MetricsCollector::collect_metrics_in_parallel(samFile* alignment_file, bam_hdr_t* alignment_file_header, const std::string& default_metrics_id) {
+    const size_t batch_size = 1024;
+    const size_t batches_per_worker = 4;
+    const size_t worker_count = std::max(1, thread_limit - 1 - thread_pool_size);
+
+    std::vector<AlignmentBatch*> batches;
+    BoundedQueue<AlignmentBatch*> free_batches(worker_count * (batches_per_worker + 1));
+    for (size_t i = 0; i < worker_count * (batches_per_worker + 1); i++) {
+        batches.push_back(new AlignmentBatch(batch_size));
+        free_batches.push(batches.back());
+    }
+
+    std::vector<std::unique_ptr<BoundedQueue<AlignmentBatch*>>> worker_queues;
+    std::vector<std::exception_ptr> worker_errors(worker_count);
+    std::vector<boost::chrono::duration<double>> worker_durations(worker_count, boost::chrono::duration<double>(0));
+    std::vector<std::thread> workers;
+
+    for (size_t w = 0; w < worker_count; w++) {
+        worker_queues.emplace_back(new BoundedQueue<AlignmentBatch*>(batches_per_worker));
+    }
+
+    for (size_t w = 0; w < worker_count; w++) {
+        workers.emplace_back([&, w] {
+            // a null batch is the signal to stop
+            while (AlignmentBatch* batch = worker_queues[w]->pop()) {
+                boost::chrono::high_resolution_clock::time_point batch_start = boost::chrono::high_resolution_clock::now();
+                if (!worker_errors[w]) {
+                    try {
+                        for (size_t i = 0; i < batch->size; i++) {
+                            batch->metrics[i]->add_alignment(alignment_file_header, batch->records[i]);
+                        }
+                    } catch (...) {
+                        // keep draining the queue so the reader can't block
+                        worker_errors[w] = std::current_exception();
+                    }
+                }
+                if (verbose) {
+                    worker_durations[w] += boost::chrono::high_resolution_clock::now() - batch_start;
+                }
+                batch->size = 0;
+                free_batches.push(batch);
+            }
+        });
+    }
+
+    boost::chrono::high_resolution_clock::time_point start = boost::chrono::high_resolution_clock::now();
+    boost::chrono::duration<double> duration;
+    double rate = 0.0;
+
+    boost::chrono::high_resolution_clock::time_point step_start;
+    boost::chrono::duration<double> decode_duration(0);
+
+    std::vector<size_t> owners;
+    std::vector<AlignmentBatch*> filling(worker_count, nullptr);
+    std::exception_ptr reader_error;
+    unsigned long long int total_reads = 0;
+    bam1_t* record = bam_init1();
+
+    try {
+        while (true) {
+            if (verbose) {
+                step_start = boost::chrono::high_resolution_clock::now();
+            }
+
+            if (read_alignment(alignment_file, alignment_file_header, record) < 0) {
+                break;
+            }
+
+            if (verbose) {
+                decode_duration += boost::chrono::high_resolution_clock::now() - step_start;
+            }
+
+            if (!in_shard(record->core.tid)) {
+                continue;
+            }
+
+            size_t index = get_metrics_index(record, default_metrics_id);
+            Metrics* m = indexed_metrics[index];
+
+            if (duplicate_marker) {
+                mark_duplicate(alignment_file_header, record, index);
+            }
+
+            while (owners.size() <= index) {
+                owners.push_back(std::hash<std::string>()(indexed_metrics[owners.size()]->name) % worker_count);
+            }
+            size_t w = owners[index];
+
+            if (!filling[w]) {
+                filling[w] = free_batches.pop();
+            }
+
+            // swap the record into the batch instead of copying it
+            AlignmentBatch* batch = filling[w];
+            std::swap(batch->records[batch->size], record);
+            batch->metrics[batch->size] = m;
+            batch->size++;
+
+            if (batch->full()) {
+                worker_queues[w]->push(batch);
+                filling[w] = nullptr;
+            }
+
+            total_reads++;
+
+            if (verbose && total_reads % 100000 == 0) {
+                duration = boost::chrono::high_resolution_clock::now() - start;
+                rate = (total_reads / duration.count());
+                std::cout << "Analyzed " << total_reads << " reads in " << duration << " (" << rate << " reads/second; " << decode_duration << " decoding)." << std::endl;
+            }
+        }
+    } catch (...) {
+        reader_error = std::current_exception();
+    }
+
+    for (size_t w = 0; w < worker_count; w++) {
+        if (filling[w]) {
+            worker_queues[w]->push(filling[w]);
+        }
+        worker_queues[w]->push(nullptr);
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    bam_destroy1(record);
+    for (auto batch : batches) {
+        delete batch;
+    }
+
+    if (reader_error) {
+        std::rethrow_exception(reader_error);
+    }
+
+    for (auto& worker_error : worker_errors) {
+        if (worker_error) {
+            std::rethrow_exception(worker_error);
+        }
+    }
+
+    if (verbose) {
+        boost::chrono::duration<double> metrics_duration(0);
+        for (auto& worker_duration : worker_durations) {
+            metrics_duration += worker_duration;
+        }
+        std::cout << "Read " << total_reads << " reads: " << decode_duration << " decoding, " << metrics_duration << " collecting metrics across " << worker_count << " worker threads." << std::endl;
+    }
+
+    return total_reads;
+}
+
+
+///
+/// Divide the references in this shard of the alignment file into
+/// chunks with roughly equal numbers of reads, as counted in the
+/// index, assuming they're spread evenly along each reference. ATAC-seq
+/// reads pile up on the mitochondrial genome, for one, so equal
+/// stretches of genome can be far from equal work. Without read counts
+/// in the index, the chunks are equal stretches of genome.
+///
+/// A chunk never crosses a reference outside the shard. The last chunk
+/// also takes the reads without a reference at the end of the file,
+/// if they're in the shard. The chunks are returned heaviest first, so
+/// the threads reading them finish at about the same time.
+///
+std::vector<AlignmentChunk> MetricsCollector::plan_alignment_chunks(const bam_hdr_t* alignment_file_header, const hts_idx_t* alignment_file_index, size_t chunk_count) const {
+    std::vector<AlignmentChunk> chunks;
+
+    // references without reads have no statistics either, so only if
+    // none of them do is the index assumed to lack them
+    std::vector<uint64_t> weights(alignment_file_header->n_targets, 0);
+    bool weigh_by_reads = false;
+    for (int32_t tid = 0; alignment_file_index && tid < alignment_file_header->n_targets; tid++) {
+        uint64_t mapped = 0, unmapped = 0;
+        if (hts_idx_get_stat(alignment_file_index, tid, &mapped, &unmapped) == 0) {
+            weights[tid] = mapped + unmapped;
+            weigh_by_reads = true;
+        }
+    }
+
+    uint64_t total_weight = 0;
+    for (int32_t tid = 0; tid < alignment_file_header->n_targets; tid++) {
+        if (!weigh_by_reads) {
+            weights[tid] = alignment_file_header->target_len[tid];
+        }
+        if (in_shard(tid)) {
+            total_weight += weights[tid];
+        }
+    }
+
+    chunk_count = std::max((size_t)1, chunk_count);
+    uint64_t chunk_weight = std::max((uint64_t)1, (total_weight + chunk_count - 1) / chunk_count);
+    uint64_t reference_start = 0;
+    AlignmentChunk chunk;
+    uint64_t chunk_start_weight = 0;
+    bool chunk_open = false;
+
+    for (int32_t tid = 0; tid < alignment_file_header->n_targets; tid++) {
+        if (!in_shard(tid)) {
+            if (chunk_open) {
+                chunk.end = coordinate_sort_key(tid, -1);
+                chunk.weight = reference_start - chunk_start_weight;
+                chunks.push_back(chunk);
+                chunk_open = false;
+            }
+            continue;
+        }
+
+        if (!chunk_open) {
+            chunk.start = coordinate_sort_key(tid, -1);
+            chunk_start_weight = reference_start;
+            chunk_open = true;
+        }
+
+        uint64_t reference_end = reference_start + weights[tid];
+
+        // place a boundary at every multiple of chunk_weight within this
+        // reference, at the position that much of its weight is before
+        uint64_t boundary = (reference_start + chunk_weight - 1) / chunk_weight * chunk_weight;
+        for (; boundary < reference_end; boundary += chunk_weight) {
+            int64_t position = (int64_t)((double)(boundary - reference_start) / weights[tid] * alignment_file_header->target_len[tid]);
+            uint64_t key = coordinate_sort_key(tid, position);
+            if (boundary > 0 && key > chunk.start) {
+                chunk.end = key;
+                chunk.weight = boundary - chunk_start_weight;
+                chunks.push_back(chunk);
+                chunk.start = key;
+                chunk_start_weight = boundary;
+            }
+        }
+
+        reference_start = reference_end;
+    }
+
+    if (in_shard(-1)) {
+        if (!chunk_open) {
+            chunk.start = coordinate_sort_key(-1, -1);
+            chunk_start_weight = reference_start;
+        }
+        chunk.end = UINT64_MAX;
+        chunk.weight = reference_start - chunk_start_weight + (weigh_by_reads ? hts_idx_get_n_no_coor(alignment_file_index) : 0);
+        chunks.push_back(chunk);
+    } else if (chunk_open) {
+        chunk.end = coordinate_sort_key(-1, -1);
+        chunk.weight = reference_start - chunk_start_weight;
+        chunks.push_back(chunk);
+    }
+
+    std::stable_sort(chunks.begin(), chunks.end(), [](const AlignmentChunk& a, const AlignmentChunk& b) {return a.weight > b.weight;});
+
+    return chunks;
+}
+
+
+///
+/// Measure one chunk of the alignment file, adding its records to
+/// this thread's replicas of the collector's Metrics.
+///
+unsigned long long int MetricsCollector::collect_chunk_metrics(const AlignmentChunk& chunk, AlignmentReaderPool& readers, const std::string& default_metrics_id, MetricsReplicas& replicas, std::mutex& metrics_mutex) {
+    AlignmentReader* reader = readers.borrow();
+    samFile* alignment_file = reader->file;
+    bam_hdr_t* alignment_file_header = reader->header;
+    const hts_idx_t* alignment_file_index = reader->index;
+    bam1_t* record = reader->record;
+    unsigned long long int total_reads = 0;
+
+    try {
+        // The first chunk starts right after the header. Others start
+        // at the BGZF offset the index gives for the first reference
+        // at or after the chunk start with any reads, or if there are
+        // none before the end of the chunk, at the unplaced reads.
+        int64_t offset = reader->first_record_offset;
+        if (chunk.start > 0) {
+            offset = -1;
+            int64_t start_tid = chunk.start >> 32;
+            int64_t end_tid = std::min((int64_t)alignment_file_header->n_targets - 1, (int64_t)(chunk.end >> 32));
+            for (int64_t tid = start_tid; offset < 0 && tid <= end_tid; tid++) {
+                int64_t start_pos = tid == start_tid ? std::max((int64_t)(chunk.start & 0xffffffff) - 1, (int64_t)0) : 0;
+                hts_itr_t* iterator = sam_itr_queryi(alignment_file_index, tid, start_pos, alignment_file_header->target_len[tid]);
+                if (iterator) {
+                    if (iterator->n_off > 0) {
+                        offset = iterator->off[0].u;
+                    }
+                    sam_itr_destroy(iterator);
+                }
+            }
+
+            if (offset < 0 && chunk.end == UINT64_MAX) {
+                hts_itr_t* iterator = sam_itr_queryi(alignment_file_index, HTS_IDX_NOCOOR, 0, 0);
+                if (iterator) {
+                    if (!iterator->finished) {
+                        offset = iterator->curr_off;
+                    }
+                    sam_itr_destroy(iterator);
+                }
+            }
+        }
+
+        bool readable = offset >= 0;
+        if (readable && bgzf_seek(alignment_file->fp.bgzf, offset, SEEK_SET) < 0) {
+            throw FileException("Could not seek in alignment file \"" + alignment_filename + "\".");
+        }
+
+        while (readable && read_alignment(alignment_file, alignment_file_header, record) >= 0) {
+            uint64_t key = coordinate_sort_key(record->core.tid, record->core.pos);
+            if (key < chunk.start) {
+                continue;
+            }
+
+            if (key >= chunk.end) {
+                break;
+            }
+
+            MetricsKey metrics_key = (this->*metrics_key_getter)(record, default_metrics_id);
+            size_t index = replicas.keys.find(metrics_key);
+            if (index == MetricsKeyTable::npos) {
+                // the collector's Metrics are only prototypes
+                // here: copy them before any reads are added
+                std::lock_guard<std::mutex> lock(metrics_mutex);
+                replicas.metrics.push_back(new Metrics(*get_metrics(record, default_metrics_id)));
+                index = replicas.keys.insert(metrics_key);
+            }
+
+            replicas.metrics[index]->add_alignment(alignment_file_header, record);
+            total_reads++;
+        }
+
+        // the next chunk this thread reads may not follow this one,
+        // so mates can't be left waiting for partners across the gap
+        for (auto replica : replicas.metrics) {
+            replica->release_tss_mates();
+        }
+    } catch (...) {
+        readers.give_back(reader);
+        throw;
+    }
+
+    readers.give_back(reader);
+
+    return total_reads;
+}
+
+
+///
+/// Split an indexed, coordinate-sorted BAM file into chunks and
+/// measure them on several threads. Each thread adds reads to its own
+/// replicas of the Metrics, which are merged into the collector's
+/// Metrics once every chunk has been read. Mates that land in
+/// different chunks are no problem: unlikely fragment sizes are only
+/// diagnosed after the merge, against the longest proper pair seen in
+/// the whole file.
+///
+unsigned long long int MetricsCollector::collect_metrics_in_chunks(bam_hdr_t* alignment_file_header, const hts_idx_t* alignment_file_index, const std::string& default_metrics_id) {
+    const size_t worker_count = thread_limit;
+    std::vector<AlignmentChunk> chunks = plan_alignment_chunks(alignment_file_header, alignment_file_index, worker_count * 4);
+
+    if (verbose) {
+        std::cout << "Reading " << chunks.size() << " chunks of the alignment file with " << worker_count << " threads." << std::endl;
+    }
+
+    AlignmentReaderPool readers(alignment_filename, alignment_file_index);
+    std::mutex metrics_mutex;
+    std::atomic<size_t> next_chunk(0);
+    std::vector<MetricsReplicas> replicas(worker_count);
+    std::vector<unsigned long long int> worker_reads(worker_count, 0);
+    std::vector<std::exception_ptr> worker_errors(worker_count);
+    std::vector<std::thread> workers;
+
+    for (size_t w = 0; w < worker_count; w++) {
+        workers.emplace_back([&, w] {
+            try {
+                for (size_t c = next_chunk++; c < chunks.size(); c = next_chunk++) {
+                    boost::chrono::high_resolution_clock::time_point chunk_start = boost::chrono::high_resolution_clock::now();
+                    unsigned long long int chunk_reads = collect_chunk_metrics(chunks[c], readers, default_metrics_id, replicas[w], metrics_mutex);
+                    worker_reads[w] += chunk_reads;
+
+                    if (verbose) {
+                        boost::chrono::duration<double> chunk_duration = boost::chrono::high_resolution_clock::now() - chunk_start;
+                        std::lock_guard<std::mutex> lock(metrics_mutex);
+                        std::cout << "Analyzed " << chunk_reads << " reads in chunk " << (c + 1) << " of " << chunks.size() << " in " << chunk_duration << "." << std::endl;
+                    }
+                }
+            } catch (...) {
+                worker_errors[w] = std::current_exception();
+                // make the other threads stop at their next chunk
+                next_chunk = chunks.size();
+            }
+        });
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    unsigned long long int total_reads = 0;
+    for (size_t w = 0; w < worker_count; w++) {
+        for (auto replica : replicas[w].metrics) {
+            if (!worker_errors[w]) {
+                metrics.at(replica->name)->merge(*replica);
+            }
+            delete replica;
+        }
+        total_reads += worker_reads[w];
+    }
+
+    for (auto& worker_error : worker_errors) {
+        if (worker_error) {
+            std::rethrow_exception(worker_error);
+        }
+    }
+
+    if (verbose) {
+        std::cout << "Read " << total_reads << " reads in " << chunks.size() << " chunks." << std::endl;
+    }
+
+    return total_reads;
+}
+
+
+Metrics::Metrics(MetricsCollector* collector, const std::string& name): collector(collector), name(name), peaks(), modules(collector->metrics_modules), log_problematic_reads(collector->log_problematic_reads), less_redundant(collector->less_redundant) {
+
+    if (log_problematic_reads && collector->problematic_read_sample_size > 0) {
+        // seeded by name, so the same examples are picked every run
+        MetricsKey key;
+        key.add(name.c_str(), name.size());
+        problematic_read_sample = ProblematicReadSample(collector->problematic_read_sample_size, key.hash);
+    } else if (log_problematic_reads) {
+        if (!collector->problematic_read_writer) {
+            collector->problematic_read_writer = std::make_shared<ProblematicReadWriter>();
+        }
+
+        try {
+            problematic_read_filename = make_metrics_filename(".problems");
+
+            if (collector->verbose) {
+                std::cout << "Logging problematic reads to " << problematic_read_filename << "." << std::endl << std::endl;
+            }
+
+            problematic_read_stream = mostream(problematic_read_filename);
+        } catch (FileException& e) {
+            throw FileException("Could not open problematic read file " + problematic_read_filename + ": " + e.what());
+        }
+    }
+
+    if (!collector->peak_filename.empty() && (modules & PEAK_METRICS)) {
+        peaks_requested = true;
+        load_peaks();
+        peaks.index_references(collector->reference_names);
+    }
+
+    if (!collector->tss_filename.empty() && (modules & TSS_METRICS)) {
+        tss_requested = true;
+        tss_coverage_requested = collector->output_tss_coverage;
+
+        if (tss_coverage_requested) {
+            for (int i = 1; i <= 1 + 2 * collector->tss_extension; i++) {
+                tss_coverage[i] = 0;
+            }
+        }
+
+    }
+
+    // only the requested modules' histograms take up room
+    if (modules & FRAGMENT_LENGTH_METRICS) {
+        fragment_length_counts.allocate();
+    }
+    if (modules & MAPQ_METRICS) {
+        mapq_counts.allocate();
+    }
+
+    choose_alignment_adder();
+}
+
+
+std::string Metrics::make_metrics_filename(const std::string& suffix) {
+    return name + collector->shard_suffix() + suffix;
+}
+
+
+void Metrics::log_problematic_read(const std::string& problem, const bam_hdr_t* header, const bam1_t* record) {
+    if (!log_problematic_reads) {
+        return;
+    }
+
+    if (collector->problematic_read_sample_size > 0) {
+        problematic_read_sample.add(problem, [header, record] {return record_to_string(header, record);});
+    } else {
+        collector->problematic_read_writer->add(problematic_read_stream, problem, header, record);
+    }
+}
+
+
+void Metrics::log_problematic_read(const std::string& problem, const std::string& text) {
+    if (!log_problematic_reads) {
+        return;
+    }
+
+    if (collector->problematic_read_sample_size > 0) {
+        problematic_read_sample.add(problem, [&text] {return text;});
+    } else {
+        collector->problematic_read_writer->add(problematic_read_stream, problem, text);
+    }
+}
+
+
+const ProblematicReadSample& Metrics::get_problematic_read_sample() const {
+    return problematic_read_sample;
+}
+
+
+void Metrics::make_aggregate_diagnoses() {
+    // without the diagnosis, improper reads were simply counted
+    if (!(modules & IMPROPER_METRICS)) {
+        return;
+    }
+
+    // last-minute classification of undiagnosed reads
+    reads_with_mate_too_distant = 0;
+    reads_mapped_and_paired_but_improperly = 0;
+
+    for (const auto& suspect : unlikely_fragment_sizes) {
+        if (maximum_proper_pair_fragment_size < suspect.first) {
+            reads_with_mate_too_distant += suspect.second;
+        } else {
+            reads_mapped_and_paired_but_improperly += suspect.second;
+        }
+    }
+
+    if (unlikely_fragment_reads) {
+        unlikely_fragment_reads->replay([this](const std::string& read_name, unsigned long long int fragment_size) {
+            if (maximum_proper_pair_fragment_size < fragment_size) {
+                log_problematic_read("Mate too distant", read_name);
+            } else {
+                log_problematic_read("Undiagnosed", read_name);
+            }
+        });
+        unlikely_fragment_reads = nullptr;
+    }
+}
+
+
+//
+// The Metrics counters that are simply summed when merging, by the
+// names used for them in saved state.
+//
+static const std::vector<std::pair<std::string, unsigned long long int Metrics::*>> metrics_counters = {
+    {"total_reads", &Metrics::total_reads},
+    {"forward_reads", &Metrics::forward_reads},
+    {"reverse_reads", &Metrics::reverse_reads},
+    {"secondary_reads", &Metrics::secondary_reads},
+    {"supplementary_reads", &Metrics::supplementary_reads},
+    {"duplicate_reads", &Metrics::duplicate_reads},
+    {"paired_reads", &Metrics::paired_reads},
+    {"paired_and_mapped_reads", &Metrics::paired_and_mapped_reads},
+    {"properly_paired_and_mapped_reads", &Metrics::properly_paired_and_mapped_reads},
+    {"first_reads", &Metrics::first_reads},
+    {"second_reads", &Metrics::second_reads},
+    {"forward_mate_reads", &Metrics::forward_mate_reads},
+    {"reverse_mate_reads", &Metrics::reverse_mate_reads},
+    {"fr_reads", &Metrics::fr_reads},
+    {"unmapped_reads", &Metrics::unmapped_reads},
+    {"unmapped_mate_reads", &Metrics::unmapped_mate_reads},
+    {"qcfailed_reads", &Metrics::qcfailed_reads},
+    {"unpaired_reads", &Metrics::unpaired_reads},
+    {"ff_reads", &Metrics::ff_reads},
+    {"rf_reads", &Metrics::rf_reads},
+    {"rr_reads", &Metrics::rr_reads},
+    {"reads_with_mate_mapped_to_different_reference", &Metrics::reads_with_mate_mapped_to_different_reference},
+    {"reads_mapped_with_zero_quality", &Metrics::reads_mapped_with_zero_quality},
+    {"reads_mapped_and_paired_but_improperly", &Metrics::reads_mapped_and_paired_but_improperly},
+    {"unclassified_reads", &Metrics::unclassified_reads},
+    {"reads_with_mate_too_distant", &Metrics::reads_with_mate_too_distant},
+    {"total_autosomal_reads", &Metrics::total_autosomal_reads},
+    {"total_mitochondrial_reads", &Metrics::total_mitochondrial_reads},
+    {"duplicate_autosomal_reads", &Metrics::duplicate_autosomal_reads},
+    {"duplicate_mitochondrial_reads", &Metrics::duplicate_mitochondrial_reads},
+    {"hqaa", &Metrics::hqaa},
+    {"hqaa_short_count", &Metrics::hqaa_short_count},
+    {"hqaa_mononucleosomal_count", &Metrics::hqaa_mononucleosomal_count},
+    {"tss_flanking_count", &Metrics::tss_flanking_count},
+    {"tss_count", &Metrics::tss_count}
+};
+
+
+///
+/// Update the flag counters with the counts of a run of flags.
+///
+void Metrics::add_flag_counts(const uint16_t* flags, size_t count) {
+    unsigned long long int totals[FLAG_COUNTER_COUNT] = {};
+    count_flag_counters(flags, count, totals);
+
+    forward_reads += totals[FORWARD_COUNTER];
+    reverse_reads += totals[REVERSE_COUNTER];
+    secondary_reads += totals[SECONDARY_COUNTER];
+    supplementary_reads += totals[SUPPLEMENTARY_COUNTER];
+    duplicate_reads += totals[DUPLICATE_COUNTER];
+    first_reads += totals[FIRST_COUNTER];
+    second_reads += totals[SECOND_COUNTER];
+    forward_mate_reads += totals[FORWARD_MATE_COUNTER];
+    reverse_mate_reads += totals[REVERSE_MATE_COUNTER];
+    paired_reads += totals[PAIRED_COUNTER];
+}
+
+
+void Metrics::count_pending_flags() {
+    add_flag_counts(pending_flags, pending_flag_count);
+    pending_flag_count = 0;
+}
+
+
+///
+/// Add the measurements of another Metrics instance for the same read
+/// group, as when replicas have each measured part of a file.
+///
+void Metrics::merge(const Metrics& other) {
+    for (const auto& counter : metrics_counters) {
+        this->*counter.second += other.*counter.second;
+    }
+
+    add_flag_counts(other.pending_flags, other.pending_flag_count);
+
+    maximum_proper_pair_fragment_size = std::max(maximum_proper_pair_fragment_size, other.maximum_proper_pair_fragment_size);
+
+    // Problematic reads are only logged from a single pass, so there
+    // are never read names to merge.
+    for (const auto& suspect : other.unlikely_fragment_sizes) {
+        unlikely_fragment_sizes[suspect.first] += suspect.second;
+    }
+
+    fragment_length_counts.merge(other.fragment_length_counts);
+
+    if (other.chromosome_counts.size() > chromosome_counts.size()) {
+        chromosome_counts.resize(other.chromosome_counts.size());
+    }
+    for (size_t tid = 0; tid < other.chromosome_counts.size(); tid++) {
+        chromosome_counts[tid] += other.chromosome_counts[tid];
+    }
+
+    mapq_counts.merge(other.mapq_counts);
+
+    for (const auto& it : other.tss_coverage) {
+        tss_coverage[it.first] += it.second;
+    }
+
+    if (tss_coverage_changes.size() < other.tss_coverage_changes.size()) {
+        tss_coverage_changes.resize(other.tss_coverage_changes.size(), 0);
+    }
+    for (size_t base = 0; base < other.tss_coverage_changes.size(); base++) {
+        tss_coverage_changes[base] += other.tss_coverage_changes[base];
+    }
+
+    // pair up fragments whose mates were read in different chunks
+    for (const auto& it : other.tss_fragments_deferred) {
+        if (tss_fragments_credited.erase(it.first) == 0) {
+            tss_fragments_deferred.insert(it);
+        }
+    }
+    for (const auto& qname : other.tss_fragments_credited) {
+        if (tss_fragments_deferred.erase(qname) == 0) {
+            tss_fragments_credited.insert(qname);
+        }
+    }
+
+    peaks.merge(other.peaks);
+}
+
+
+///
+/// Save the raw measurements, before any aggregate diagnoses or
+/// derived metrics, so they can be merged with those from other
+/// shards of the same alignment file.
+///
+nlohmann::json Metrics::state_to_json() {
+    nlohmann::json counters;
+    for (const auto& counter : metrics_counters) {
+        counters[counter.first] = this->*counter.second;
+    }
 
-            problematic_read_stream = mostream(problematic_read_filename);
-        } catch (FileException& e) {
-            throw FileException("Could not open problematic read file " + problematic_read_filename + ": " + e.what());
+    // the histograms are saved as [bucket, count] pairs, skipping empty buckets
+    nlohmann::json fragment_length_counts_json = nlohmann::json::array();
+    for (size_t bucket = 0; bucket <= fragment_length_counts.size; bucket++) {
+        if (fragment_length_counts[bucket] > 0) {
+            fragment_length_counts_json.push_back({bucket, fragment_length_counts[bucket]});
         }
     }
 
-    if (!collector->peak_filename.empty()) {
-        peaks_requested = true;
-        load_peaks();
+    nlohmann::json unlikely_fragment_sizes_json = nlohmann::json::array();
+    for (const auto& suspect : unlikely_fragment_sizes) {
+        unlikely_fragment_sizes_json.push_back({suspect.first, suspect.second});
     }
 
-    if (!collector->tss_filename.empty()) {
-        tss_requested = true;
-        tss_coverage_requested = collector->output_tss_coverage;
-
-        if (tss_coverage_requested) {
-            for (int i = 1; i <= 1 + 2 * collector->tss_extension; i++) {
-                tss_coverage[i] = 0;
-            }
+    nlohmann::json mapq_counts_json = nlohmann::json::array();
+    for (size_t bucket = 0; bucket <= mapq_counts.size; bucket++) {
+        if (mapq_counts[bucket] > 0) {
+            mapq_counts_json.push_back({bucket, mapq_counts[bucket]});
         }
-
     }
-}
 
+    nlohmann::json tss_coverage_json = nlohmann::json::array();
+    for (const auto& it : tss_coverage) {
+        tss_coverage_json.push_back({it.first, it.second});
+    }
 
-std::string Metrics::make_metrics_filename(const std::string& suffix) {
-    return name + suffix;
+    return {
+        {"name", name},
+        {"library", library.to_json()},
+        {"peaks_requested", peaks_requested},
+        {"tss_requested", tss_requested},
+        {"tss_coverage_requested", tss_coverage_requested},
+        {"less_redundant", less_redundant},
+        {"counters", counters},
+        {"maximum_proper_pair_fragment_size", maximum_proper_pair_fragment_size},
+        {"unlikely_fragment_sizes", unlikely_fragment_sizes_json},
+        {"fragment_length_counts", fragment_length_counts_json},
+        {"chromosome_counts", chromosome_counts},
+        {"mapq_counts", mapq_counts_json},
+        {"tss_coverage", tss_coverage_json},
+        {"peaks", peaks.state_to_json()}
+    };
 }
 
 
-void Metrics::log_problematic_read(const std::string& problem, const std::string& record) {
-    if (!log_problematic_reads) {
-        return;
-    }
+void Metrics::load_state(const nlohmann::json& state) {
+    name = state["name"];
+    library.from_json(state["library"]);
+    peaks_requested = state["peaks_requested"];
+    tss_requested = state["tss_requested"];
+    tss_coverage_requested = state["tss_coverage_requested"];
+    less_redundant = state["less_redundant"];
 
-    *problematic_read_stream << problem;
+    for (const auto& counter : metrics_counters) {
+        this->*counter.second = state["counters"][counter.first];
+    }
 
-    if (!record.empty()) {
-        *problematic_read_stream << '\t' << record;
+    maximum_proper_pair_fragment_size = state["maximum_proper_pair_fragment_size"];
+    unlikely_fragment_sizes.clear();
+    for (const auto& it : state["unlikely_fragment_sizes"]) {
+        unlikely_fragment_sizes[it[0].get<unsigned long long int>()] = it[1];
     }
 
-    *problematic_read_stream << '\n';
-}
+    fragment_length_counts.clear();
+    for (const auto& it : state["fragment_length_counts"]) {
+        fragment_length_counts.set(it[0].get<size_t>(), it[1]);
+    }
 
+    chromosome_counts = state["chromosome_counts"].get<std::vector<unsigned long long int>>();
 
-void Metrics::make_aggregate_diagnoses() {
-    // last-minute classification of undiagnosed reads
-    reads_with_mate_too_distant = 0;
-    reads_mapped_and_paired_but_improperly = 0;
+    mapq_counts.clear();
+    for (const auto& it : state["mapq_counts"]) {
+        mapq_counts.set(it[0].get<size_t>(), it[1]);
+    }
 
-    for (auto&& suspect_iterator : unlikely_fragment_sizes) {
-        for (auto&& unlikely_fragment_size : suspect_iterator.second) {
-            if (maximum_proper_pair_fragment_size < unlikely_fragment_size) {
-                reads_with_mate_too_distant++;
-                if (log_problematic_reads) {
-                    log_problematic_read("Mate too distant", suspect_iterator.first);
-                }
-            } else {
-                reads_mapped_and_paired_but_improperly++;
-                if (log_problematic_reads) {
-                    log_problematic_read("Undiagnosed", suspect_iterator.first);
-                }
-            }
-        }
-        suspect_iterator.second.clear();
+    tss_coverage.clear();
+    for (const auto& it : state["tss_coverage"]) {
+        tss_coverage[it[0].get<int>()] = it[1];
     }
+
+    peaks.load_state(state["peaks"]);
 }
 
 
@@ -554,7 +2405,7 @@ std::string Metrics::configuration_string() const {
 }
 
 
-bool Metrics::is_hqaa(const bam_hdr_t* header, const bam1_t* record) {
+bool Metrics::is_hqaa(const bam_hdr_t* /* header */, const bam1_t* record) {
     bool hqaa = false;
 
     if (
@@ -567,8 +2418,7 @@ bool Metrics::is_hqaa(const bam_hdr_t* header, const bam1_t* record) {
         (record->core.qual >= 30) &&
         (record->core.tid >= 0)) {
 
-        std::string reference_name(header->target_name[record->core.tid]);
-        if (is_autosomal(reference_name)) {
+        if (collector->is_autosomal_tid(record->core.tid)) {
             hqaa = true;
         }
     }
@@ -643,8 +2493,8 @@ bool Metrics::is_rr(const bam1_t* record) {
 
 double Metrics::mean_mapq() const {
     unsigned long long int total_mapq = 0;
-    for (auto it : mapq_counts) {
-        total_mapq += it.first * it.second;
+    for (size_t mapq = 0; mapq < mapq_counts.size; mapq++) {
+        total_mapq += mapq * mapq_counts[mapq];
     }
     return (double) total_mapq / total_reads;
 }
@@ -672,21 +2522,25 @@ double Metrics::median_mapq() const {
     }
 
     unsigned long long int mapq_index = 0;
-    for (auto it : mapq_counts) {
+    for (size_t mapq = 0; mapq < mapq_counts.size; mapq++) {
+        unsigned long long int count = mapq_counts[mapq];
+        if (count == 0) {
+            continue;
+        }
 
-        unsigned long long int next_mapq_index = mapq_index + it.second;
+        unsigned long long int next_mapq_index = mapq_index + count;
         bool median1_here = (mapq_index <= median1 && median1 <= next_mapq_index);
         bool median2_here = (mapq_index <= median2 && median2 <= next_mapq_index);
 
         if (median1_here) {
-            median += it.first;
+            median += mapq;
         }
 
         if (median2_here) {
-            median += it.first;
+            median += mapq;
             median /= 2;
         }
-        mapq_index += it.second;
+        mapq_index += count;
     }
     return median;
 }
@@ -696,13 +2550,8 @@ double Metrics::median_fragment_length() const {
     double median = 0.0;
 
     unsigned long long int total_fragments = 0;
-    int max_fragment_length = std::min(1000, std::max(1000, fragment_length_counts.empty() ? 0 : fragment_length_counts.rbegin()->first));
-
-    for (auto it : fragment_length_counts) {
-        if (it.first > max_fragment_length) {
-            continue;
-        }
-        total_fragments += it.second;
+    for (size_t fragment_length = 0; fragment_length < fragment_length_counts.size; fragment_length++) {
+        total_fragments += fragment_length_counts[fragment_length];
     }
 
     if (total_fragments == 0) {
@@ -724,26 +2573,24 @@ double Metrics::median_fragment_length() const {
     }
 
     unsigned long long int index = 0;
-    for (auto it : fragment_length_counts) {
-        if (it.first > max_fragment_length) {
+    for (size_t fragment_length = 0; fragment_length < fragment_length_counts.size; fragment_length++) {
+        unsigned long long int count = fragment_length_counts[fragment_length];
+        if (count == 0) {
             continue;
         }
-        if (it.second == 0) {
-            continue;
-        }
-        unsigned long long int next_index = index + it.second;
+        unsigned long long int next_index = index + count;
         bool median1_here = (index <= median1 && median1 < next_index);
         bool median2_here = (index <= median2 && median2 < next_index);
 
         if (median1_here) {
-            median += it.first;
+            median += fragment_length;
         }
 
         if (median2_here) {
-            median += it.first;
+            median += fragment_length;
             median /= 2;
         }
-        index += it.second;
+        index += count;
     }
     return median;
 }
@@ -780,94 +2627,87 @@ void MetricsCollector::load_excluded_regions() {
 ///
 /// Measure and record a single read
 ///
-void Metrics::add_alignment(const bam_hdr_t* header, const bam1_t* record) {
+template <bool TSS, bool Peaks, bool Logging, bool Verbose, unsigned int Modules>
+void Metrics::add_alignment_as(const bam_hdr_t* header, const bam1_t* record) {
     unsigned long long int fragment_length = llabs(record->core.isize);
 
     total_reads++;
 
-    // record the read's quality
-    mapq_counts[record->core.qual]++;
-
-    if (IS_REVERSE(record)) {
-        reverse_reads++;
-    } else {
-        forward_reads++;
-    }
-
-    if (IS_SECONDARY(record)) {
-        secondary_reads++;
-    }
-
-    if (IS_SUPPLEMENTARY(record)) {
-        supplementary_reads++;
-    }
-
-    if (IS_DUP(record)) {
-        duplicate_reads++;
-    }
-
-    if (IS_READ1(record)) {
-        first_reads++;
+    if (TSS) {
+        add_tss_coverage(header, record);
     }
 
-    if (IS_READ2(record)) {
-        second_reads++;
+    // record the read's quality
+    if (Modules & MAPQ_METRICS) {
+        mapq_counts.add(record->core.qual);
     }
 
-    if (IS_MATE_REVERSE(record)) {
-        reverse_mate_reads++;
-    } else {
-        forward_mate_reads++;
-    }
+    uint32_t flag_class = classify_flag(record->core.flag);
 
-    if (IS_PAIRED(record)) {
-        paired_reads++;
+    pending_flags[pending_flag_count++] = record->core.flag;
+    if (pending_flag_count == flag_block_size) {
+        count_pending_flags();
     }
 
-    if (IS_QCFAIL(record)) {
+    // The flag settles everything up to the RF check, which needs
+    // the insert size too.
+    switch (flag_class_category(flag_class)) {
+    case QC_FAILED_CATEGORY:
         qcfailed_reads++;
-        if (log_problematic_reads) {
-            log_problematic_read("QC failed", record_to_string(header, record));
+        if (Logging) {
+            log_problematic_read("QC failed", header, record);
         }
-    } else if (!IS_PAIRED(record)) {
+        return;
+    case UNPAIRED_CATEGORY:
         unpaired_reads++;
-        if (log_problematic_reads) {
-            log_problematic_read("Unpaired", record_to_string(header, record));
+        if (Logging) {
+            log_problematic_read("Unpaired", header, record);
         }
-    } else if (IS_UNMAPPED(record)) {
+        return;
+    case UNMAPPED_CATEGORY:
         unmapped_reads++;
-        if (log_problematic_reads) {
-            log_problematic_read("Unmapped", record_to_string(header, record));
+        if (Logging) {
+            log_problematic_read("Unmapped", header, record);
         }
-    } else if (IS_MATE_UNMAPPED(record)) {
+        return;
+    case MATE_UNMAPPED_CATEGORY:
         unmapped_mate_reads++;
-        if (log_problematic_reads) {
-            log_problematic_read("Unmapped mate", record_to_string(header, record));
-        }
-    } else if (is_rf(record)) {
-        rf_reads++;
-        if (log_problematic_reads) {
-            log_problematic_read("RF", record_to_string(header, record));
+        if (Logging) {
+            log_problematic_read("Unmapped mate", header, record);
         }
-    } else if (is_ff(record)) {
+        return;
+    case FF_CATEGORY:
         ff_reads++;
-        if (log_problematic_reads) {
-            log_problematic_read("FF", record_to_string(header, record));
+        if (Logging) {
+            log_problematic_read("FF", header, record);
         }
-    } else if (is_rr(record)) {
+        return;
+    case RR_CATEGORY:
         rr_reads++;
-        if (log_problematic_reads) {
-            log_problematic_read("RR", record_to_string(header, record));
+        if (Logging) {
+            log_problematic_read("RR", header, record);
+        }
+        return;
+    case PROPERLY_PAIRED_CATEGORY:
+    case IMPROPERLY_PAIRED_CATEGORY:
+        break;
+    }
+
+    if (is_rf(record)) {
+        rf_reads++;
+        if (Logging) {
+            log_problematic_read("RF", header, record);
         }
     } else if (record->core.qual == 0) {
         reads_mapped_with_zero_quality++;
-        if (log_problematic_reads) {
-            log_problematic_read("Mapped with zero quality", record_to_string(header, record));
+        if (Logging) {
+            log_problematic_read("Mapped with zero quality", header, record);
         }
-    } else if (IS_PAIRED_AND_MAPPED(record)) {
+    } else {
+        // the flag has already shown the read and its mate are paired and mapped
         paired_and_mapped_reads++;
 
-        if (IS_PROPERLYPAIRED(record)) {
+        if (flag_class_category(flag_class) == PROPERLY_PAIRED_CATEGORY) {
             properly_paired_and_mapped_reads++;
 
             if (is_fr(record)) {
@@ -878,19 +2718,20 @@ void Metrics::add_alignment(const bam_hdr_t* header, const bam1_t* record) {
             // mitochondrial if it's properly paired and mapped and
             // (of course) has a valid reference name
             if (record->core.tid >= 0) {
-                std::string reference_name(header->target_name[record->core.tid]);
+                int32_t tid = record->core.tid;
 
-                if (is_mitochondrial(reference_name)) {
+                if (collector->is_mitochondrial_tid(tid)) {
                     total_mitochondrial_reads++;
                     if (IS_DUP(record)) {
                         duplicate_mitochondrial_reads++;
                     }
                 } else {
-                    if (is_autosomal(reference_name)) {
+                    if (collector->is_autosomal_tid(tid)) {
                         total_autosomal_reads++;
 
-                        if (!peaks.empty()) {
-                            peaks.record_alignment(Feature(header, record), is_hqaa(header, record), IS_DUP(record));
+                        bool hqaa_read = is_hqaa(header, record);
+                        if (Peaks) {
+                            peaks.record_alignment(Interval(record), hqaa_read, IS_DUP(record));
                         }
 
                         if (IS_DUP(record)) {
@@ -899,19 +2740,26 @@ void Metrics::add_alignment(const bam_hdr_t* header, const bam1_t* record) {
                             // nonduplicate, properly paired and uniquely mapped
                             // autosomal reads will be the basis of our fragment
                             // size and peak statistics
-                            if (is_hqaa(header, record)) {
+                            if (hqaa_read) {
                                 hqaa++;
-                                chromosome_counts[reference_name]++;
+                                if (Modules & CHROMOSOME_METRICS) {
+                                    if ((size_t)tid >= chromosome_counts.size()) {
+                                        chromosome_counts.resize(tid + 1);
+                                    }
+                                    chromosome_counts[tid]++;
+                                }
 
                                 // record proper pairs' fragment lengths
-                                fragment_length_counts[fragment_length]++;
+                                if (Modules & FRAGMENT_LENGTH_METRICS) {
+                                    fragment_length_counts.add(fragment_length);
 
-                                if (50 <= fragment_length && fragment_length <= 100) {
-                                    hqaa_short_count++;
-                                }
+                                    if (50 <= fragment_length && fragment_length <= 100) {
+                                        hqaa_short_count++;
+                                    }
 
-                                if (150 <= fragment_length && fragment_length <= 200) {
-                                    hqaa_mononucleosomal_count++;
+                                    if (150 <= fragment_length && fragment_length <= 200) {
+                                        hqaa_mononucleosomal_count++;
+                                    }
                                 }
                             }
                         }
@@ -931,9 +2779,9 @@ void Metrics::add_alignment(const bam_hdr_t* header, const bam1_t* record) {
             // identify those that mapped too far from their
             // mates.
             //
-            if (IS_PRIMARY(record) &&  maximum_proper_pair_fragment_size < fragment_length) {
+            if ((Modules & IMPROPER_METRICS) && IS_PRIMARY(record) && maximum_proper_pair_fragment_size < fragment_length) {
                 maximum_proper_pair_fragment_size = fragment_length;
-                if (collector->verbose) {
+                if (Verbose) {
                     std::cerr << "New maximum proper pair fragment length: " << maximum_proper_pair_fragment_size << " from [" << record_to_string(header, record) << "]" << std::endl;
                 }
             }
@@ -950,31 +2798,87 @@ void Metrics::add_alignment(const bam_hdr_t* header, const bam1_t* record) {
             // or simply alignment to regions homologous between the X
             // and Y chromosomes.
             reads_with_mate_mapped_to_different_reference++;
-            if (log_problematic_reads) {
-                log_problematic_read("Mate mapped to different reference", record_to_string(header, record));
+            if (Logging) {
+                log_problematic_read("Mate mapped to different reference", header, record);
             }
         } else {
             // OK, the read was paired, and mapped, but not in a
             // proper pair, for a reason we don't yet know. Its
             // mate may have mapped too far away, but we can't
-            // check until we've seen all the reads.
-            std::string record_name = get_qname(record);
-            unlikely_fragment_sizes[record_name].push_back(fragment_length);
-            if (log_problematic_reads) {
-                log_problematic_read("Improper", record_to_string(header, record));
+            // check until we've seen all the reads -- unless the
+            // diagnosis wasn't requested, when it's just counted.
+            if (!(Modules & IMPROPER_METRICS)) {
+                reads_mapped_and_paired_but_improperly++;
+                if (Logging) {
+                    log_problematic_read("Improper", header, record);
+                }
+                return;
+            }
+
+            unlikely_fragment_sizes[fragment_length]++;
+            if (Logging) {
+                if (!unlikely_fragment_reads) {
+                    unlikely_fragment_reads = std::make_shared<NameValueSpill>();
+                }
+                unlikely_fragment_reads->add(get_qname(record), fragment_length);
+                log_problematic_read("Improper", header, record);
             }
-        }
-    } else {
-        // Most cases should have been caught by now, so let's
-        // make a special note of any unexpected oddballs.
-        unclassified_reads++;
-        if (log_problematic_reads) {
-            log_problematic_read("Unclassified", record_to_string(header, record));
         }
     }
 }
 
 
+template <bool TSS, bool Peaks, bool Logging, bool Verbose>
+Metrics::AlignmentAdder Metrics::choose_module_adder(unsigned int modules) {
+    static_assert(FRAGMENT_LENGTH_METRICS == 1 && MAPQ_METRICS == 2 && CHROMOSOME_METRICS == 4 && IMPROPER_METRICS == 32, "the adders are listed by the modules' flag values");
+
+    static const AlignmentAdder adders[] = {
+        &Metrics::add_alignment_as<TSS, Peaks, Logging, Verbose, 0>,
+        &Metrics::add_alignment_as<TSS, Peaks, Logging, Verbose, 1>,
+        &Metrics::add_alignment_as<TSS, Peaks, Logging, Verbose, 2>,
+        &Metrics::add_alignment_as<TSS, Peaks, Logging, Verbose, 3>,
+        &Metrics::add_alignment_as<TSS, Peaks, Logging, Verbose, 4>,
+        &Metrics::add_alignment_as<TSS, Peaks, Logging, Verbose, 5>,
+        &Metrics::add_alignment_as<TSS, Peaks, Logging, Verbose, 6>,
+        &Metrics::add_alignment_as<TSS, Peaks, Logging, Verbose, 7>,
+        &Metrics::add_alignment_as<TSS, Peaks, Logging, Verbose, 32>,
+        &Metrics::add_alignment_as<TSS, Peaks, Logging, Verbose, 33>,
+        &Metrics::add_alignment_as<TSS, Peaks, Logging, Verbose, 34>,
+        &Metrics::add_alignment_as<TSS, Peaks, Logging, Verbose, 35>,
+        &Metrics::add_alignment_as<TSS, Peaks, Logging, Verbose, 36>,
+        &Metrics::add_alignment_as<TSS, Peaks, Logging, Verbose, 37>,
+        &Metrics::add_alignment_as<TSS, Peaks, Logging, Verbose, 38>,
+        &Metrics::add_alignment_as<TSS, Peaks, Logging, Verbose, 39>,
+    };
+
+    return adders[(modules & 7) | ((modules & IMPROPER_METRICS) ? 8 : 0)];
+}
+
+
+void Metrics::choose_alignment_adder() {
+    static AlignmentAdder (* const choosers[])(unsigned int modules) = {
+        &Metrics::choose_module_adder<false, false, false, false>,
+        &Metrics::choose_module_adder<false, false, false, true>,
+        &Metrics::choose_module_adder<false, false, true, false>,
+        &Metrics::choose_module_adder<false, false, true, true>,
+        &Metrics::choose_module_adder<false, true, false, false>,
+        &Metrics::choose_module_adder<false, true, false, true>,
+        &Metrics::choose_module_adder<false, true, true, false>,
+        &Metrics::choose_module_adder<false, true, true, true>,
+        &Metrics::choose_module_adder<true, false, false, false>,
+        &Metrics::choose_module_adder<true, false, false, true>,
+        &Metrics::choose_module_adder<true, false, true, false>,
+        &Metrics::choose_module_adder<true, false, true, true>,
+        &Metrics::choose_module_adder<true, true, false, false>,
+        &Metrics::choose_module_adder<true, true, false, true>,
+        &Metrics::choose_module_adder<true, true, true, false>,
+        &Metrics::choose_module_adder<true, true, true, true>,
+    };
+
+    alignment_adder = choosers[(tss_requested ? 8 : 0) | (!peaks.empty() ? 4 : 0) | (log_problematic_reads ? 2 : 0) | (collector->verbose ? 1 : 0)](modules);
+}
+
+
 void Metrics::load_peaks() {
     std::string peak_filename = collector->peak_filename;
 
@@ -1024,407 +2928,275 @@ void Metrics::load_peaks() {
 }
 
 
-std::map<std::string,std::map<int, unsigned long long int>> MetricsCollector::get_tss_coverage_for_reference(const std::string &reference, const int extension) {
-    std::map<std::string,std::map<int, unsigned long long int>> ref_tss_cov = {};
-
-    ReferenceFeatureCollection *tss_collection = tss_tree.get_reference_feature_collection(reference);
-
-    if (!tss_collection->features.empty()) {
-        samFile *alignment_file = nullptr;
-        bam_hdr_t *alignment_file_header = nullptr;
-        hts_idx_t *alignment_file_index = nullptr;
-        bam1_t *record = bam_init1();
-
-        try {
-            if (alignment_filename.empty()) {
-                throw FileException("Alignment file has not been specified.");
-            }
-
-            if ((alignment_file = sam_open(alignment_filename.c_str(), "r")) == nullptr) {
-                throw FileException("Could not open alignment file \"" + alignment_filename + "\".");
-            }
-
-            if ((alignment_file_index = sam_index_load(alignment_file, alignment_filename.c_str())) == nullptr) {
-                throw FileException("Could not open index for alignment file \"" + alignment_filename + "\".");
-            }
-
-            alignment_file_header = sam_hdr_read(alignment_file);
-            if (alignment_file_header == NULL) {
-                throw FileException("Could not read a valid header from alignment file \"" + alignment_filename +  "\".");
-            }
-
-            for (auto tss : tss_collection->features) {
-                std::map<std::string, bool> fragments_seen = {};
-
-                Feature tss_region(tss);
-                tss_region.start = std::max((unsigned long long int)0, tss_region.start - extension);
-                tss_region.end += extension;
+//
+// The same test as Feature::overlaps, for intervals on one reference.
+//
+static bool intervals_overlap(int64_t start, int64_t end, int64_t other_start, int64_t other_end) {
+    return
+        (start <= other_start && other_start < end) ||
+        (start < other_end && other_end < end) ||
+        (other_start <= start && start < other_end) ||
+        (other_start < end && end < other_end);
+}
 
-                std::stringstream query;
 
-                // The HTSlib iterator starts at the first record starting after the beginning of the region, so
-                // we ask for records further before and after the TSS region, then filter them ourselves
-                query << tss_region.reference << ":" << std::max(tss_region.start - extension * 2, 0ULL) << "-" << (tss_region.end + extension * 2);
+///
+/// Credit a fragment's TSS coverage as its mates stream past, once per
+/// fragment, pairing mates by query name hash.
+///
+void Metrics::add_tss_coverage(const bam_hdr_t* header, const bam1_t* record) {
+    int32_t tid = record->core.tid;
+    uint64_t key = coordinate_sort_key(tid, record->core.pos);
 
-                hts_itr_t *alignment_iterator;
-                if ((alignment_iterator = sam_itr_querys(alignment_file_index, alignment_file_header, query.str().c_str())) == nullptr) {
-                    std::cerr <<  "Could not find TSS region " << query.str() << " in your BAM file. Check that your TSS file's chromosome naming scheme matches your reference." << std::endl;
-                    continue;
-                }
+    if (collector->coordinate_sorted && !tss_mate_expiry.empty()) {
+        expire_tss_mates(key);
+    } else if (collector->query_grouped && !tss_mates.empty()) {
+        expire_other_tss_mates(hash_qname(record));
+    }
 
-                while (sam_itr_next(alignment_file, alignment_iterator, record) >= 0) {
-                    if (is_hqaa(alignment_file_header, record)) {
-                        std::string qname = get_qname(record);
-                        if (fragments_seen.count(qname) == 0) {
-                            Feature fragment;
-                            fragment.reference = reference;
-                            fragment.start = std::min(record->core.pos, record->core.mpos);
-                            fragment.end = fragment.start + abs(record->core.isize);
-                            fragments_seen[qname] = true;
-
-                            if (fragment.overlaps(tss_region)) {
-                                std::string default_metrics_id = name.empty() ? basename(alignment_filename) : name;
-                                uint8_t* rgaux = bam_aux_get(record, "RG");
-                                uint8_t* bcaux = bam_aux_get(record, nucleus_barcode_tag.c_str());
-                                std::string barcode = bcaux ? bam_aux2Z(bcaux) : "no_barcode";
-                                std::string read_group_id = rgaux ? bam_aux2Z(rgaux) : default_metrics_id;
-                                std::string metrics_id;
-
-                                if (!ignore_read_groups && is_single_nucleus) {
-                                    metrics_id = read_group_id + "-" + barcode;
-                                } else if (ignore_read_groups && is_single_nucleus) {
-                                    metrics_id = barcode;
-                                } else if (ignore_read_groups && !is_single_nucleus) {
-                                    metrics_id = default_metrics_id;
-                                } else {
-                                    metrics_id = read_group_id;
-                                }
+    // only primary alignments in pairs mapped to one reference can be HQAA
+    if (tid < 0 || tid >= (int32_t)collector->tss_windows.size() || collector->tss_windows[tid].empty() ||
+        !IS_PAIRED_AND_MAPPED(record) || !IS_PRIMARY(record) || record->core.mtid != tid) {
+        return;
+    }
 
-                                for (unsigned long long int pos = tss_region.start; pos <= tss_region.end; pos++) {
-                                    if (pos >= fragment.start && pos <= fragment.end) {
-                                        int base = tss.is_reverse() ? (tss_region.end - pos) : (pos - tss_region.start);
-                                        ref_tss_cov[metrics_id][base]++;
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-            }
+    int64_t start = std::min(record->core.pos, record->core.mpos);
+    int64_t end = start + llabs(record->core.isize);
 
-            bam_destroy1(record);
-            bam_hdr_destroy(alignment_file_header);
-            hts_idx_destroy(alignment_file_index);
-            if (alignment_file) {
-                hts_close(alignment_file);
-            }
-        } catch (FileException& e) {
-            bam_destroy1(record);
-            bam_hdr_destroy(alignment_file_header);
-            hts_idx_destroy(alignment_file_index);
-            if (alignment_file) {
-                hts_close(alignment_file);
-            }
-            throw;
+    const std::vector<TSSWindow>& windows = collector->tss_windows[tid];
+    size_t first_window = find_tss_window(tid, start);
+    bool near_tss = false;
+    for (size_t i = first_window; i < windows.size() && windows[i].start <= end; i++) {
+        if (intervals_overlap(start, end, windows[i].start, windows[i].end)) {
+            near_tss = true;
+            break;
         }
     }
 
-    return ref_tss_cov;
-}
-
-void MetricsCollector::calculate_tss_coverage() {
-
-    if (tss_filename == "") {
+    if (!near_tss) {
         return;
     }
 
-    if (verbose) {
-        std::cout << "Calculating TSS coverage..." << std::endl;
-    }
+    uint64_t qname_hash = hash_qname(record);
+    bool hqaa_mate = is_hqaa(header, record);
 
-    boost::chrono::high_resolution_clock::time_point start = boost::chrono::high_resolution_clock::now();
-    boost::chrono::duration<double> duration;
+    auto waiting = tss_mates.find(qname_hash);
+    if (waiting != tss_mates.end() && waiting->second.mate_key == key && waiting->second.fragment.start == start) {
+        // the whole fragment's been seen
+        if (waiting->second.hqaa || hqaa_mate) {
+            credit_tss_coverage(tid, start, end, waiting->second.first_window);
+        }
+        tss_mates.erase(waiting);
+    } else if (record->core.pos <= record->core.mpos || collector->query_grouped) {
+        if (waiting != tss_mates.end()) {
+            // a different fragment whose name has the same hash
+            TSSMate& mate = waiting->second;
+            if (mate.hqaa) {
+                credit_tss_coverage(mate.fragment.tid, mate.fragment.start, mate.fragment.end, mate.first_window);
+            }
+            tss_mates.erase(waiting);
+        }
+
+        TSSMate& mate = tss_mates[qname_hash];
+        mate.fragment.tid = tid;
+        mate.fragment.start = start;
+        mate.fragment.end = end;
+        mate.first_window = first_window;
+        mate.mate_key = coordinate_sort_key(tid, record->core.mpos);
+        mate.hqaa = hqaa_mate;
+        if (collector->coordinate_sorted) {
+            tss_mate_expiry.push(std::make_pair(mate.mate_key, qname_hash));
+        }
+    } else if (tss_fragments_credited.erase(qname_hash) == 0 && hqaa_mate) {
+        // the leftmost mate was read in another chunk, or the file
+        // isn't coordinate-sorted and it's yet to come
+        TSSFragment fragment;
+        fragment.tid = tid;
+        fragment.start = start;
+        fragment.end = end;
+        tss_fragments_deferred[qname_hash] = fragment;
+    }
+}
 
-    double tss_count = (double) tss_tree.size();
-    std::map<std::string,std::map<int, unsigned long long int>> tss_coverage = {};
 
-    if (tss_count > 0) {
-        for (auto it: metrics) {
-            std::string metrics_id = it.first;
-            for (int i = 1; i <= 1 + 2 * tss_extension; i++) {
-                tss_coverage[metrics_id][i] = 0;
+///
+/// Give up on the mates whose partners should have been read before
+/// the given coordinate_sort_key, crediting their fragments if they
+/// were HQAA.
+///
+void Metrics::expire_tss_mates(uint64_t key) {
+    while (!tss_mate_expiry.empty() && tss_mate_expiry.top().first < key) {
+        auto waiting = tss_mates.find(tss_mate_expiry.top().second);
+        // a mate that was paired, or replaced, leaves a stale entry
+        if (waiting != tss_mates.end() && waiting->second.mate_key == tss_mate_expiry.top().first) {
+            const TSSMate& mate = waiting->second;
+            if (mate.hqaa) {
+                credit_tss_coverage(mate.fragment.tid, mate.fragment.start, mate.fragment.end, mate.first_window);
             }
+            tss_mates.erase(waiting);
         }
+        tss_mate_expiry.pop();
+    }
+}
 
-        std::vector<std::future<std::map<std::string,std::map<int, unsigned long long int>>>> results = {};
-        int thread_count = 0;
-        for (auto reference : tss_tree.get_references_by_feature_count()) {
-            results.push_back(std::async(std::launch::async, &MetricsCollector::get_tss_coverage_for_reference, this, reference, tss_extension));
-            thread_count++;
-            if (verbose) {
-                std::cout << "Added TSS coverage for " << reference << "; thread count=" << thread_count << std::endl;
-            }
-            while (thread_count == thread_limit) {
-                for (auto result = results.begin(); result != results.end(); result++) {
-                    if (!(*result).valid()) {
-                        results.erase(result);
-                        thread_count--;
-                        break;
-                    } else {
-                        std::future_status status = (*result).wait_for(std::chrono::milliseconds(100));
-                        if (status == std::future_status::ready) {
-                            auto ref_cov = (*result).get();
-                            for (auto it: metrics) {
-                                std::string metrics_id = it.first;
-                                for (int i = 1; i <= 1 + 2 * tss_extension; i++) {
-                                    tss_coverage[metrics_id][i] += ref_cov[metrics_id][i];
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-        }
 
-        if (verbose) {
-            std::cout << "All TSS jobs started. Waiting for last ones to complete." << std::endl;
+///
+/// In a file grouped by query name, a mate's partner comes before any
+/// other query's reads, so once they start, give up on the waiting
+/// mate, crediting its fragment if it was HQAA.
+///
+void Metrics::expire_other_tss_mates(uint64_t qname_hash) {
+    for (auto waiting = tss_mates.begin(); waiting != tss_mates.end();) {
+        if (waiting->first == qname_hash) {
+            ++waiting;
+            continue;
         }
 
-        while (!results.empty()) {
-            for (auto result = results.begin(); result != results.end(); result++) {
-                if (!(*result).valid()) {
-                    results.erase(result);
-                    break;
-                }
-
-                std::future_status status = (*result).wait_for(std::chrono::milliseconds(100));
-                if (status == std::future_status::ready) {
-                    auto ref_cov = (*result).get();
-                    for (auto it: metrics) {
-                        std::string metrics_id = it.first;
-                        for (int i = 1; i <= 1 + 2 * tss_extension; i++) {
-                            tss_coverage[metrics_id][i] += ref_cov[metrics_id][i];
-                        }
-                    }
-                }
-            }
+        const TSSMate& mate = waiting->second;
+        if (mate.hqaa) {
+            credit_tss_coverage(mate.fragment.tid, mate.fragment.start, mate.fragment.end, mate.first_window);
         }
+        waiting = tss_mates.erase(waiting);
+    }
+}
 
-        for (auto it: metrics) {
-            Metrics* m = it.second;
-            m->tss_coverage = tss_coverage[it.first];
+
+///
+/// Once a stretch of the file has been read, settle the mates still
+/// waiting for partners: pair them with any deferred rightmost mates,
+/// or credit them and note that they were, in case their partners are
+/// read elsewhere.
+///
+void Metrics::release_tss_mates() {
+    for (const auto& it : tss_mates) {
+        const TSSMate& mate = it.second;
+        if (tss_fragments_deferred.erase(it.first) > 0) {
+            // the partner was HQAA
+            credit_tss_coverage(mate.fragment.tid, mate.fragment.start, mate.fragment.end, mate.first_window);
+        } else if (mate.hqaa) {
+            credit_tss_coverage(mate.fragment.tid, mate.fragment.start, mate.fragment.end, mate.first_window);
+            tss_fragments_credited.insert(it.first);
         }
     }
 
-    duration = boost::chrono::high_resolution_clock::now() - start;
-    if (verbose) {
-        std::cout << "Calculated TSS coverage in " << duration << "." << std::endl;
-    }
+    tss_mates.clear();
+    tss_mate_expiry = decltype(tss_mate_expiry)();
 }
 
-std::map<std::string,std::map<std::string, unsigned long long int>> MetricsCollector::get_tss_coverage_summary_for_reference(const std::string &reference, const int extension) {
-    std::map<std::string,std::map<std::string, unsigned long long int>> ref_tss_cov = {};
-
-    ReferenceFeatureCollection *tss_collection = tss_tree.get_reference_feature_collection(reference);
-
-    if (!tss_collection->features.empty()) {
-        samFile *alignment_file = nullptr;
-        bam_hdr_t *alignment_file_header = nullptr;
-        hts_idx_t *alignment_file_index = nullptr;
-        bam1_t *record = bam_init1();
 
-        try {
-            if (alignment_filename.empty()) {
-                throw FileException("Alignment file has not been specified.");
-            }
+///
+/// Return the index of the first TSS window on the reference that
+/// could overlap a fragment starting at the given position. Alignments
+/// usually arrive in coordinate order, so the cursor just moves
+/// forward; when it can't, we search for the window again.
+///
+size_t Metrics::find_tss_window(int32_t tid, int64_t start) {
+    const std::vector<TSSWindow>& windows = collector->tss_windows[tid];
 
-            if ((alignment_file = sam_open(alignment_filename.c_str(), "r")) == nullptr) {
-                throw FileException("Could not open alignment file \"" + alignment_filename + "\".");
-            }
+    if (tid != tss_cursor_tid || start < tss_cursor_position) {
+        tss_cursor = std::upper_bound(windows.begin(), windows.end(), start, [](int64_t position, const TSSWindow& window) {return position < window.reach;}) - windows.begin();
+        tss_cursor_tid = tid;
+    } else {
+        while (tss_cursor < windows.size() && windows[tss_cursor].reach <= start) {
+            tss_cursor++;
+        }
+    }
+    tss_cursor_position = start;
 
-            if ((alignment_file_index = sam_index_load(alignment_file, alignment_filename.c_str())) == nullptr) {
-                throw FileException("Could not open index for alignment file \"" + alignment_filename + "\".");
-            }
+    return tss_cursor;
+}
 
-            alignment_file_header = sam_hdr_read(alignment_file);
-            if (alignment_file_header == NULL) {
-                throw FileException("Could not read a valid header from alignment file \"" + alignment_filename +  "\".");
-            }
 
-            for (auto tss : tss_collection->features) {
-                std::map<std::string, bool> fragments_seen = {};
+//
+// The number of bases from first to last that fall between
+// range_start and range_end, inclusive.
+//
+static int64_t bases_in_range(int64_t first, int64_t last, int64_t range_start, int64_t range_end) {
+    return std::max((int64_t)0, std::min(last, range_end) - std::max(first, range_start) + 1);
+}
 
-                Feature tss_region(tss);
-                tss_region.start = std::max((unsigned long long int)0, tss_region.start - extension);
-                tss_region.end += extension;
 
-                std::stringstream query;
+void Metrics::credit_tss_coverage(int32_t tid, int64_t start, int64_t end, size_t first_window) {
+    const std::vector<TSSWindow>& windows = collector->tss_windows[tid];
+    int extension = collector->tss_extension;
+    int flanking_size = 100; // flanking region used in the eventual TSS enrichment calculation
 
-                // The HTSlib iterator starts at the first record starting after the beginning of the region, so
-                // we ask for records further before and after the TSS region, then filter them ourselves
-                query << tss_region.reference << ":" << std::max(tss_region.start - extension * 2, 0ULL) << "-" << (tss_region.end + extension * 2);
+    if (first_window == SIZE_MAX) {
+        first_window = find_tss_window(tid, start);
+    }
 
-                hts_itr_t *alignment_iterator;
-                if ((alignment_iterator = sam_itr_querys(alignment_file_index, alignment_file_header, query.str().c_str())) == nullptr) {
-                    std::cerr <<  "Could not find TSS region " << query.str() << " in your BAM file. Check that your TSS file's chromosome naming scheme matches your reference." << std::endl;
-                    continue;
-                }
+    for (size_t i = first_window; i < windows.size() && windows[i].start <= end; i++) {
+        const TSSWindow& window = windows[i];
+        if (!intervals_overlap(start, end, window.start, window.end)) {
+            continue;
+        }
 
-                while (sam_itr_next(alignment_file, alignment_iterator, record) >= 0) {
-                    if (is_hqaa(alignment_file_header, record)) {
-                        std::string qname = get_qname(record);
-                        if (fragments_seen.count(qname) == 0) {
-                            Feature fragment;
-                            fragment.reference = reference;
-                            fragment.start = std::min(record->core.pos, record->core.mpos);
-                            fragment.end = fragment.start + abs(record->core.isize);
-                            fragments_seen[qname] = true;
-
-                            if (fragment.overlaps(tss_region)) {
-                                std::string default_metrics_id = name.empty() ? basename(alignment_filename) : name;
-                                uint8_t* rgaux = bam_aux_get(record, "RG");
-                                uint8_t* bcaux = bam_aux_get(record, nucleus_barcode_tag.c_str());
-                                std::string barcode = bcaux ? bam_aux2Z(bcaux) : "no_barcode";
-                                std::string read_group_id = rgaux ? bam_aux2Z(rgaux) : default_metrics_id;
-                                std::string metrics_id;
-
-                                if (!ignore_read_groups && is_single_nucleus) {
-                                    metrics_id = read_group_id + "-" + barcode;
-                                } else if (ignore_read_groups && is_single_nucleus) {
-                                    metrics_id = barcode;
-                                } else if (ignore_read_groups && !is_single_nucleus) {
-                                    metrics_id = default_metrics_id;
-                                } else {
-                                    metrics_id = read_group_id;
-                                }
+        // the window bases, counted from the upstream end, that the
+        // fragment covers
+        int64_t first_position = std::max(start, window.start);
+        int64_t last_position = std::min(end, window.end);
+        if (first_position > last_position) {
+            continue;
+        }
+        int64_t first_base = window.reverse ? (window.end - last_position) : (first_position - window.start);
+        int64_t last_base = window.reverse ? (window.end - first_position) : (last_position - window.start);
 
-                                for (unsigned long long int pos = tss_region.start; pos <= tss_region.end; pos++) {
-                                    if (pos >= fragment.start && pos <= fragment.end) {
-                                        int base = tss.is_reverse() ? (tss_region.end - pos) : (pos - tss_region.start);
-                                        int flanking_size = 100; // flanking region used in the eventual TSS enrichment calculation
-                                        if ((base > 0 && base <= flanking_size) || base > (1 + (2 * extension) - flanking_size)) {
-                                            ref_tss_cov[metrics_id]["flanking"]++;
-                                        }
-                                        if (base == (1 + extension)) {
-                                            ref_tss_cov[metrics_id]["tss"]++;
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                    }
+        if (tss_coverage_requested) {
+            first_base = std::max(first_base, (int64_t)1);
+            last_base = std::min(last_base, (int64_t)(1 + 2 * extension));
+            if (first_base <= last_base) {
+                if (tss_coverage_changes.empty()) {
+                    tss_coverage_changes.resize(3 + 2 * extension, 0);
                 }
+                tss_coverage_changes[first_base] += window.count;
+                tss_coverage_changes[last_base + 1] -= window.count;
             }
-
-            bam_destroy1(record);
-            bam_hdr_destroy(alignment_file_header);
-            hts_idx_destroy(alignment_file_index);
-            if (alignment_file) {
-                hts_close(alignment_file);
-            }
-        } catch (FileException& e) {
-            bam_destroy1(record);
-            bam_hdr_destroy(alignment_file_header);
-            hts_idx_destroy(alignment_file_index);
-            if (alignment_file) {
-                hts_close(alignment_file);
+        } else {
+            // the bases in either flank, which overlap if the
+            // extension is shorter than the flanks
+            int64_t upstream_end = flanking_size;
+            int64_t downstream_start = 2 + 2 * extension - flanking_size;
+            tss_flanking_count += window.count * (
+                bases_in_range(first_base, last_base, 1, upstream_end) +
+                bases_in_range(first_base, last_base, downstream_start, last_base) -
+                bases_in_range(first_base, last_base, std::max(downstream_start, (int64_t)1), upstream_end));
+
+            if (first_base <= 1 + extension && 1 + extension <= last_base) {
+                tss_count += window.count;
             }
-            throw;
         }
     }
-
-    return ref_tss_cov;
 }
 
-void MetricsCollector::calculate_tss_coverage_summary() {
-
-    if (tss_filename == "") {
-        return;
-    }
 
-    if (verbose) {
-        std::cout << "Calculating TSS coverage summary..." << std::endl;
+///
+/// Add the accumulated changes in TSS coverage to tss_coverage.
+///
+void Metrics::sum_tss_coverage_changes() {
+    long long int coverage = 0;
+    for (size_t base = 1; base + 1 < tss_coverage_changes.size(); base++) {
+        coverage += tss_coverage_changes[base];
+        tss_coverage[base] += coverage;
     }
+    tss_coverage_changes.clear();
+}
 
-    boost::chrono::high_resolution_clock::time_point start = boost::chrono::high_resolution_clock::now();
-    boost::chrono::duration<double> duration;
-
-    double number_tss = (double) tss_tree.size();
-    std::map<std::string,unsigned long long int> tss_flanking_count = {};
-    std::map<std::string,unsigned long long int> tss_count = {};
-
-    if (number_tss > 0) {
-        for (auto it: metrics) {
-            std::string metrics_id = it.first;
-            tss_flanking_count[metrics_id] = 0;
-            tss_count[metrics_id] = 0;
-        }
-
-        std::vector<std::future<std::map<std::string,std::map<std::string, unsigned long long int>>>> results = {};
-        int thread_count = 0;
-        for (auto reference : tss_tree.get_references_by_feature_count()) {
-            results.push_back(std::async(std::launch::async, &MetricsCollector::get_tss_coverage_summary_for_reference, this, reference, tss_extension));
-            thread_count++;
-            if (verbose) {
-                std::cout << "Added TSS coverage summary for " << reference << "; thread count=" << thread_count << std::endl;
-            }
-            while (thread_count == thread_limit) {
-                for (auto result = results.begin(); result != results.end(); result++) {
-                    if (!(*result).valid()) {
-                        results.erase(result);
-                        thread_count--;
-                        break;
-                    } else {
-                        std::future_status status = (*result).wait_for(std::chrono::milliseconds(100));
-                        if (status == std::future_status::ready) {
-                            auto ref_cov = (*result).get();
-                            for (auto it: metrics) {
-                                std::string metrics_id = it.first;
-                                tss_flanking_count[metrics_id] += ref_cov[metrics_id]["flanking"];
-                                tss_count[metrics_id] += ref_cov[metrics_id]["tss"];
-                            }
-                        }
-                    }
-                }
-            }
-        }
-
-        if (verbose) {
-            std::cout << "All TSS jobs started. Waiting for last ones to complete." << std::endl;
-        }
-
-        while (!results.empty()) {
-            for (auto result = results.begin(); result != results.end(); result++) {
-                if (!(*result).valid()) {
-                    results.erase(result);
-                    break;
-                }
-
-                std::future_status status = (*result).wait_for(std::chrono::milliseconds(100));
-                if (status == std::future_status::ready) {
-                    auto ref_cov = (*result).get();
-                    for (auto it: metrics) {
-                        std::string metrics_id = it.first;
-                        tss_flanking_count[metrics_id] += ref_cov[metrics_id]["flanking"];
-                        tss_count[metrics_id] += ref_cov[metrics_id]["tss"];
-                    }
-                }
-            }
-        }
 
-        for (auto it: metrics) {
-            Metrics* m = it.second;
-            m->tss_flanking_count = tss_flanking_count[it.first];
-            m->tss_count = tss_count[it.first];
-        }
+///
+/// Once every read has been added, credit the fragments whose
+/// leftmost mates didn't.
+///
+void Metrics::settle_tss_coverage() {
+    for (const auto& it : tss_fragments_deferred) {
+        credit_tss_coverage(it.second.tid, it.second.start, it.second.end);
     }
+    tss_fragments_deferred.clear();
+    tss_fragments_credited.clear();
 
-    duration = boost::chrono::high_resolution_clock::now() - start;
-    if (verbose) {
-        std::cout << "Calculated TSS coverage in " << duration << "." << std::endl;
-    }
+    sum_tss_coverage_changes();
 }
 
+
 void Metrics::calculate_tss_metrics() {
 
     if (!tss_requested) {
@@ -1435,7 +3207,7 @@ void Metrics::calculate_tss_metrics() {
         std::cout << "Calculating TSS metrics..." << std::endl;
     }
 
-    double number_tss = (double) collector->tss_tree.size();
+    double number_tss = (double) collector->total_tss;
 
     boost::chrono::high_resolution_clock::time_point start = boost::chrono::high_resolution_clock::now();
     boost::chrono::duration<double> duration;
@@ -1610,10 +3382,8 @@ std::ostream& operator<<(std::ostream& os, const Metrics& m) {
 
     for (int threshold = 5; threshold <= 30; threshold += 5) {
         unsigned long long int count = 0;
-        for (auto it : m.mapq_counts) {
-            if (it.first >= threshold) {
-                count += it.second;
-            }
+        for (size_t mapq = threshold; mapq < m.mapq_counts.size; mapq++) {
+            count += m.mapq_counts[mapq];
         }
         os << std::setfill(' ') << std::setw(20) << std::right << threshold << ": " << count << percentage_string(count, m.total_reads) << std::endl;
     }
@@ -1663,12 +3433,32 @@ nlohmann::json Library::to_json() {
 }
 
 
+void Library::from_json(const nlohmann::json& json) {
+    library = json["library"];
+    sample = json["sample"];
+    description = json["description"];
+    center = json["sequencingcenter"];
+    date = json["sequencingdate"];
+    platform = json["sequencingplatform"];
+    platform_model = json["platformmodel"];
+    platform_unit = json["platformunit"];
+    flow_order = json["floworder"];
+    key_sequence = json["keysequence"];
+    predicted_median_insert_size = json["predicted_median_insert_size"];
+    programs = json["programs"];
+}
+
+
 nlohmann::json Metrics::to_json() {
-    std::vector<std::string> fragment_length_counts_fields = {"fragment_length", "read_count", "fraction_of_all_reads"};
-    nlohmann::json fragment_length_counts_json;
-    int max_fragment_length = std::min(1000, std::max(1000, fragment_length_counts.empty() ? 0 : fragment_length_counts.rbegin()->first));
+    // the metrics of a module left out with --metrics weren't
+    // measured, so they're reported as null rather than zero
+    auto measured = [this](unsigned int module, const nlohmann::json& value) {
+        return (modules & module) ? value : nlohmann::json(nullptr);
+    };
 
-    for (int fragment_length = 0; fragment_length <= max_fragment_length; fragment_length++) {
+    std::vector<std::string> fragment_length_counts_fields = {"fragment_length", "read_count", "fraction_of_all_reads"};
+    nlohmann::json fragment_length_counts_json = nlohmann::json::array();
+    for (int fragment_length = 0; fragment_length < (int)fragment_length_counts.size; fragment_length++) {
         int count = fragment_length_counts[fragment_length];
         nlohmann::json flc;
         flc.push_back(fragment_length);
@@ -1681,9 +3471,17 @@ nlohmann::json Metrics::to_json() {
 
     unsigned long long int max_autosome_counts = 0;
     unsigned long long int total_autosome_counts = 0;
-    nlohmann::json chromosome_counts_json;
+    nlohmann::json chromosome_counts_json = nlohmann::json::array();
+
+    // report the references by name
+    std::map<std::string, unsigned long long int> named_chromosome_counts;
+    for (size_t tid = 0; tid < chromosome_counts.size(); tid++) {
+        if (chromosome_counts[tid] > 0) {
+            named_chromosome_counts[collector->reference_names[tid]] = chromosome_counts[tid];
+        }
+    }
 
-    for (auto it : chromosome_counts) {
+    for (auto it : named_chromosome_counts) {
         std::string chromosome = it.first;
         unsigned long long int reads_from_chromosome = it.second;
         nlohmann::json cc;
@@ -1703,11 +3501,14 @@ nlohmann::json Metrics::to_json() {
 
     std::vector<std::string> mapq_counts_fields = {"mapq", "read_count"};
 
-    nlohmann::json mapq_counts_json;
-    for (auto it : mapq_counts) {
+    nlohmann::json mapq_counts_json = nlohmann::json::array();
+    for (size_t mapq = 0; mapq < mapq_counts.size; mapq++) {
+        if (mapq_counts[mapq] == 0) {
+            continue;
+        }
         nlohmann::json mc;
-        mc.push_back(it.first);
-        mc.push_back(it.second);
+        mc.push_back(mapq);
+        mc.push_back(mapq_counts[mapq]);
         mapq_counts_json.push_back(mc);
     }
 
@@ -1814,15 +3615,15 @@ nlohmann::json Metrics::to_json() {
              {"reads_mapped_with_zero_quality", reads_mapped_with_zero_quality},
              {"reads_mapped_and_paired_but_improperly", reads_mapped_and_paired_but_improperly},
              {"unclassified_reads", unclassified_reads},
-             {"maximum_proper_pair_fragment_size", maximum_proper_pair_fragment_size},
-             {"reads_with_mate_too_distant", reads_with_mate_too_distant},
+             {"maximum_proper_pair_fragment_size", measured(IMPROPER_METRICS, maximum_proper_pair_fragment_size)},
+             {"reads_with_mate_too_distant", measured(IMPROPER_METRICS, reads_with_mate_too_distant)},
              {"total_autosomal_reads", total_autosomal_reads},
              {"total_mitochondrial_reads", total_mitochondrial_reads},
              {"duplicate_autosomal_reads", duplicate_autosomal_reads},
              {"duplicate_mitochondrial_reads", duplicate_mitochondrial_reads},
-             {"hqaa_tf_count", hqaa_short_count},
-             {"hqaa_mononucleosomal_count", hqaa_mononucleosomal_count},
-             {"short_mononucleosomal_ratio", short_mononucleosomal_ratio},
+             {"hqaa_tf_count", measured(FRAGMENT_LENGTH_METRICS, hqaa_short_count)},
+             {"hqaa_mononucleosomal_count", measured(FRAGMENT_LENGTH_METRICS, hqaa_mononucleosomal_count)},
+             {"short_mononucleosomal_ratio", measured(FRAGMENT_LENGTH_METRICS, short_mononucleosomal_ratio)},
              {"hqaa_in_peaks", peaks.hqaa_in_peaks},
              {"duplicates_in_peaks", peaks.duplicates_in_peaks},
              {"duplicates_not_in_peaks", peaks.duplicates_not_in_peaks},
@@ -1832,13 +3633,13 @@ nlohmann::json Metrics::to_json() {
              {"duplicate_fraction_not_in_peaks", fraction(peaks.duplicates_not_in_peaks, peaks.ppm_not_in_peaks)},
              {"peak_duplicate_ratio", fraction(fraction(peaks.duplicates_not_in_peaks, peaks.ppm_not_in_peaks), fraction(peaks.duplicates_in_peaks, peaks.ppm_in_peaks))},
              {"fragment_length_counts_fields", fragment_length_counts_fields},
-             {"fragment_length_counts", fragment_length_counts_json},
+             {"fragment_length_counts", measured(FRAGMENT_LENGTH_METRICS, fragment_length_counts_json)},
              {"fragment_length_distance", nullptr},
-             {"median_fragment_length", median_fragment_length()},
+             {"median_fragment_length", measured(FRAGMENT_LENGTH_METRICS, median_fragment_length())},
              {"mapq_counts_fields", mapq_counts_fields},
-             {"mapq_counts", mapq_counts_json},
-             {"mean_mapq", mean_mapq()},
-             {"median_mapq", median_mapq()},
+             {"mapq_counts", measured(MAPQ_METRICS, mapq_counts_json)},
+             {"mean_mapq", measured(MAPQ_METRICS, mean_mapq())},
+             {"median_mapq", measured(MAPQ_METRICS, median_mapq())},
              {"peaks_fields", peaks_fields},
              {"peaks", peak_list},
              {"peak_percentiles", peak_percentiles},
@@ -1847,8 +3648,8 @@ nlohmann::json Metrics::to_json() {
              {"hqaa_overlapping_peaks_percent", percentage(hqaa_overlapping_peaks, hqaa)},
              {"tss_coverage", tss_coverage_vec},
              {"tss_enrichment", tss_enrichment},
-             {"chromosome_counts", chromosome_counts_json},
-             {"max_fraction_reads_from_single_autosome", max_fraction_reads_from_single_autosome}
+             {"chromosome_counts", measured(CHROMOSOME_METRICS, chromosome_counts_json)},
+             {"max_fraction_reads_from_single_autosome", measured(CHROMOSOME_METRICS, max_fraction_reads_from_single_autosome)}
          }
         }
     };
@@ -7,25 +7,281 @@
 #ifndef METRICS_HPP
 #define METRICS_HPP
 
+#include <algorithm>
+#include <cstdint>
+#include <exception>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "json.hpp"
 
 #include "Exceptions.hpp"
 #include "Features.hpp"
+#include "Flags.hpp"
 #include "HTS.hpp"
+#include "Histogram.hpp"
 #include "IO.hpp"
 #include "Peaks.hpp"
+#include "Threads.hpp"
 
 
 class MetricsCollector;
 class Metrics;
 
 
+// kinds of reference, as flags in MetricsCollector::reference_kinds
+const uint8_t AUTOSOMAL_REFERENCE = 1;
+const uint8_t MITOCHONDRIAL_REFERENCE = 2;
+
+
+// The optional groups of metrics, as flags in
+// MetricsCollector::metrics_modules. The read counts and flag-based
+// classification are always collected; each of these can be left out
+// with --metrics, so that its per-read work is skipped and its storage
+// never allocated.
+const unsigned int FRAGMENT_LENGTH_METRICS = 1;
+const unsigned int MAPQ_METRICS = 2;
+const unsigned int CHROMOSOME_METRICS = 4;
+const unsigned int PEAK_METRICS = 8;
+const unsigned int TSS_METRICS = 16;
+const unsigned int IMPROPER_METRICS = 32;
+const unsigned int ALL_METRICS = 63;
+
+// the modules whose per-read work add_alignment_as is specialized for;
+// peaks and TSS have their own template parameters
+const unsigned int PER_READ_METRICS = FRAGMENT_LENGTH_METRICS | MAPQ_METRICS | CHROMOSOME_METRICS | IMPROPER_METRICS;
+
+// the modules named in a comma-separated list, throwing
+// std::invalid_argument for an unknown name
+unsigned int parse_metrics_modules(const std::string& names);
+std::vector<std::string> metrics_module_names(unsigned int modules);
+
+
+//
+// A stretch of a coordinate-sorted alignment file, running from the
+// first record whose coordinate_sort_key is at least start to the
+// last one whose key is less than end. Its weight is an estimate of
+// the reads in it, or without index statistics, of its length.
+//
+struct AlignmentChunk {
+    uint64_t start = 0;
+    uint64_t end = 0;
+    uint64_t weight = 0;
+};
+
+
+//
+// The region around a TSS whose coverage is measured, running from
+// start up to but not including end. The reach is the furthest end of
+// this or any window sorted before it, so the first window a fragment
+// could overlap can be found with a binary search. TSS on the same
+// strand at the same position, as for a gene's isoforms, share one
+// window, whose count says how many it stands for.
+//
+struct TSSWindow {
+    int64_t start = 0;
+    int64_t end = 0;
+    int64_t reach = 0;
+    bool reverse = false;
+    unsigned int count = 1;
+};
+
+
+//
+// A Metrics ID as the pieces it's built from -- the read group, a
+// separator and the nucleus barcode, pointing into a record or the
+// collector -- along with a hash of their concatenation, so a record
+// can be matched to its Metrics without building the ID string.
+//
+struct MetricsKey {
+    const char* pieces[3] = {nullptr, nullptr, nullptr};
+    size_t lengths[3] = {0, 0, 0};
+    size_t piece_count = 0;
+    uint64_t hash = 14695981039346656037ULL;  // FNV-1a offset basis
+
+    void add(const char* piece, size_t length);
+    bool matches(const std::string& id) const;
+    std::string piece(size_t index) const;
+    std::string str() const;
+};
+
+
+//
+// An open-addressing hash table from MetricsKeys to dense indices,
+// numbered in the order their IDs were first inserted.
+//
+class MetricsKeyTable {
+private:
+    struct Slot {
+        uint64_t hash;
+        size_t index;
+    };
+
+    std::vector<Slot> slots = {};
+    std::vector<std::string> ids = {};
+
+    void grow();
+
+public:
+    static const size_t npos = SIZE_MAX;
+
+    size_t find(const MetricsKey& key) const;
+    size_t insert(const MetricsKey& key);
+    size_t size() const;
+    const std::string& id(size_t index) const;
+    void clear();
+};
+
+
+//
+// A chunk reader's own copies of the collector's Metrics, with the
+// table that finds them.
+//
+struct MetricsReplicas {
+    MetricsKeyTable keys;
+    std::vector<Metrics*> metrics = {};
+};
+
+
+//
+// A fragment whose TSS coverage is waiting on its other mate.
+//
+struct TSSFragment {
+    int32_t tid = -1;
+    int64_t start = 0;
+    int64_t end = 0;
+};
+
+
+//
+// The leftmost mate of a fragment near a TSS, waiting for the other
+// mate, which should turn up at the coordinate_sort_key mate_key. The
+// fragment's first candidate TSS window is kept so crediting it later
+// needn't search for it again.
+//
+struct TSSMate {
+    TSSFragment fragment;
+    size_t first_window = 0;
+    uint64_t mate_key = 0;
+    bool hqaa = false;
+};
+
+
+//
+// Writes problematic reads to their Metrics' streams on a background
+// thread, so formatting and compressing them stays off the ingest
+// path. Reads are copied into a fixed set of batches; when they're
+// all waiting to be written, adding another blocks until one is
+// free. Reads are written in the order they were added.
+//
+class ProblematicReadWriter {
+private:
+    struct ProblematicRead {
+        boost::shared_ptr<boost::iostreams::filtering_ostream> stream = nullptr;
+        std::string problem = "";
+        std::string text = "";
+        const bam_hdr_t* header = nullptr;
+        bam1_t* record = nullptr;
+    };
+
+    struct Batch {
+        std::vector<ProblematicRead> reads;
+        size_t size = 0;
+
+        explicit Batch(size_t capacity);
+        ~Batch();
+    };
+
+    std::vector<Batch*> batches = {};
+    BoundedQueue<Batch*> free_batches;
+    BoundedQueue<Batch*> full_batches;
+    Batch* filling = nullptr;
+    std::mutex mutex;
+
+    std::thread writer;
+    std::exception_ptr writer_error = nullptr;
+    std::map<boost::iostreams::filtering_ostream*, boost::shared_ptr<boost::iostreams::filtering_ostream>> written_streams = {};
+
+    ProblematicRead& next_read(const boost::shared_ptr<boost::iostreams::filtering_ostream>& stream, const std::string& problem);
+    void write_batches();
+
+public:
+    explicit ProblematicReadWriter(size_t batch_count = 4, size_t batch_size = 256);
+    ~ProblematicReadWriter();
+
+    ProblematicReadWriter(const ProblematicReadWriter&) = delete;
+    ProblematicReadWriter& operator=(const ProblematicReadWriter&) = delete;
+
+    void add(const boost::shared_ptr<boost::iostreams::filtering_ostream>& stream, const std::string& problem, const bam_hdr_t* header, const bam1_t* record);
+    void add(const boost::shared_ptr<boost::iostreams::filtering_ostream>& stream, const std::string& problem, const std::string& text = "");
+    void flush();
+};
+
+
+//
+// Up to a fixed number of example reads for each kind of problem,
+// chosen by reservoir sampling, with exact counts of every kind. An
+// example is only described when it's kept, so once a kind has been
+// seen many times, most of its reads cost no more than a count.
+//
+class ProblematicReadSample {
+public:
+    struct Example {
+        unsigned long long int sequence;
+        std::string text;
+    };
+
+    struct Category {
+        std::string problem;
+        unsigned long long int count;
+        std::vector<Example> examples;
+    };
+
+private:
+    size_t limit;
+    uint64_t random_state;
+    std::vector<Category> categories = {};
+
+    uint64_t next_random();
+
+public:
+    explicit ProblematicReadSample(size_t limit = 0, uint64_t seed = 0);
+
+    //
+    // Count a read with the given problem, calling describe for the
+    // text to keep if it's chosen as an example.
+    //
+    template <typename Describe>
+    void add(const std::string& problem, Describe describe) {
+        auto category = std::find_if(categories.begin(), categories.end(), [&problem](const Category& c) {return c.problem == problem;});
+        if (category == categories.end()) {
+            categories.push_back(Category{problem, 0, {}});
+            category = categories.end() - 1;
+        }
+
+        unsigned long long int sequence = category->count++;
+        if (category->examples.size() < limit) {
+            category->examples.push_back(Example{sequence, describe()});
+        } else if (limit > 0) {
+            uint64_t slot = next_random() % category->count;
+            if (slot < limit) {
+                category->examples[slot] = Example{sequence, describe()};
+            }
+        }
+    }
+
+    std::vector<Category> list_categories() const;
+};
+
+
 //
 // The MetricsCollector examines a BAM file and optionally, a BED file
 // containing peaks, to collect metrics for each read group found. If
@@ -38,6 +294,45 @@ private:
     void load_autosomal_references();
     void load_excluded_regions();
 
+    // used by the alignment reader for BGZF decompression, with
+    // thread_pool_size threads
+    htsThreadPool thread_pool = {nullptr, 0};
+    int thread_pool_size = 0;
+    void start_thread_pool(int size);
+    void stop_thread_pool();
+    void use_thread_pool(samFile* alignment_file);
+    void limit_cram_decoding(samFile* alignment_file);
+
+    // marks duplicates in the main pass, when asked to
+    std::shared_ptr<DuplicateMarker> duplicate_marker = nullptr;
+    samFile* marked_alignment_file = nullptr;
+    void start_marking_duplicates(const bam_hdr_t* alignment_file_header);
+    void stop_marking_duplicates(bool complete);
+    void mark_duplicate(const bam_hdr_t* alignment_file_header, bam1_t* record, size_t metrics_index);
+
+    // whether records are read with read_bam_record instead of sam_read1
+    bool reading_lean = false;
+    int read_alignment(samFile* alignment_file, bam_hdr_t* alignment_file_header, bam1_t* record) const;
+
+    // the Metrics seen in the main pass, by their keys' dense indices
+    MetricsKeyTable metrics_keys;
+    std::vector<Metrics*> indexed_metrics = {};
+
+    // Building a record's key is specialized at compile time for how
+    // reads are grouped, and the specialization for the run chosen
+    // once in load_alignments.
+    template <bool IgnoreReadGroups, bool SingleNucleus>
+    MetricsKey get_metrics_key(const bam1_t* record, const std::string& default_metrics_id) const;
+    MetricsKey (MetricsCollector::*metrics_key_getter)(const bam1_t* record, const std::string& default_metrics_id) const = &MetricsCollector::get_metrics_key<false, false>;
+    void choose_metrics_key_getter();
+    size_t get_metrics_index(const bam1_t* record, const std::string& default_metrics_id);
+    Metrics* get_metrics(const bam1_t* record, const std::string& default_metrics_id);
+    unsigned long long int collect_metrics(samFile* alignment_file, bam_hdr_t* alignment_file_header, const std::string& default_metrics_id);
+    unsigned long long int collect_metrics_in_parallel(samFile* alignment_file, bam_hdr_t* alignment_file_header, const std::string& default_metrics_id);
+    std::vector<AlignmentChunk> plan_alignment_chunks(const bam_hdr_t* alignment_file_header, const hts_idx_t* alignment_file_index, size_t chunk_count) const;
+    unsigned long long int collect_metrics_in_chunks(bam_hdr_t* alignment_file_header, const hts_idx_t* alignment_file_index, const std::string& default_metrics_id);
+    unsigned long long int collect_chunk_metrics(const AlignmentChunk& chunk, AlignmentReaderPool& readers, const std::string& default_metrics_id, MetricsReplicas& replicas, std::mutex& metrics_mutex);
+
 public:
     std::map<std::string, Metrics*, numeric_string_comparator> metrics;
 
@@ -57,11 +352,33 @@ public:
     // consider when recording fragment lengths or overlap with peaks.
     std::map<std::string, std::unordered_map<std::string, int>, numeric_string_comparator> autosomal_references;
 
+    // The alignment file's references, by ID, and the kind of each,
+    // worked out once so records can be classified by reference ID.
+    std::vector<std::string> reference_names = {};
+    std::vector<uint8_t> reference_kinds = {};
+
     std::string peak_filename = "auto";
 
     std::string tss_filename = "";
     const int tss_extension = 1000;
     FeatureTree tss_tree;
+    unsigned long long int total_tss = 0;
+
+    // the TSS windows on each reference, indexed by reference ID and
+    // sorted by start, built once the alignment file header is read
+    std::vector<std::vector<TSSWindow>> tss_windows = {};
+
+    // the optional metrics to collect
+    unsigned int metrics_modules = ALL_METRICS;
+
+    // whether the alignment file's header says it's coordinate-sorted
+    bool coordinate_sorted = false;
+
+    // whether it says all of a query's records are adjacent, as in
+    // name-sorted or collated aligner output. Only the pairing of TSS
+    // fragment mates uses this; every read is still classified, and
+    // its fragment length taken from its insert size, on its own.
+    bool query_grouped = false;
 
     bool verbose = false;
     int thread_limit = 1;
@@ -71,9 +388,39 @@ public:
     bool output_tss_coverage = true;
     bool less_redundant = false;
 
+    // When logging problematic reads, keep at most this many examples
+    // of each problem per Metrics, and write them all to one file.
+    // Zero means every problematic read goes to its Metrics' own file.
+    size_t problematic_read_sample_size = 0;
+
+    // With more than one shard, only the references whose IDs leave a
+    // remainder of shard_index - 1 when divided by shard_count are
+    // measured, plus the reads with no reference in the last shard.
+    int shard_index = 1;
+    int shard_count = 1;
+
+    // With mark_duplicates, the duplicate flags in a coordinate-sorted
+    // alignment file are ignored, and duplicates are marked as it's
+    // read instead. If marked_alignment_filename is given, the marked
+    // alignments are written there.
+    bool mark_duplicates = false;
+    std::string marked_alignment_filename = "";
+
+    // the FASTA file of the reference a CRAM file was compressed
+    // against, when it can't be found through the CRAM header
+    std::string reference_filename = "";
+
+    // If lean_bam_reading is set, a BAM file's records are read
+    // without htslib's per-record CIGAR checks; see read_bam_record.
+    bool lean_bam_reading = false;
+
     std::vector<std::string> excluded_region_filenames = {};
     std::vector<Feature> excluded_regions = {};
 
+    // shared by all the Metrics logging problematic reads, started
+    // by the first of them
+    std::shared_ptr<ProblematicReadWriter> problematic_read_writer = nullptr;
+
     MetricsCollector(const std::string& name = "",
                      const std::string& organism = "human",
                      const std::string& nucleus_barcode_tag = "",
@@ -95,19 +442,30 @@ public:
                      bool less_redundant = false,
                      const std::vector<std::string>& excluded_region_filenames = {});
 
+    static MetricsCollector from_state(const nlohmann::json& state, bool verbose = false);
+    static void check_state(const nlohmann::json& state);
+
     std::string autosomal_reference_string(std::string separator = ", ") const;
+    std::vector<std::string> organism_autosomal_references() const;
     std::string configuration_string() const;
+    bool in_shard(int32_t tid) const;
+    std::string shard_suffix() const;
     bool is_autosomal(const std::string &reference_name);
+    bool is_autosomal_tid(int32_t tid) const;
     bool is_mitochondrial(const std::string& reference_name);
+    bool is_mitochondrial_tid(int32_t tid) const;
     bool is_hqaa(const bam_hdr_t* header, const bam1_t* record);
+    void classify_references(const std::vector<std::string>& names);
     void load_tss();
+    void make_tss_windows(const bam_hdr_t* header);
     void load_alignments();
-    std::map<std::string,std::map<int, unsigned long long int>> get_tss_coverage_for_reference(const std::string &reference, const int extension);
-    std::map<std::string,std::map<std::string, unsigned long long int>> get_tss_coverage_summary_for_reference(const std::string &reference, const int extension);
-    void calculate_tss_coverage();
-    void calculate_tss_coverage_summary();
+    void finalize();
+    nlohmann::json state_to_json();
+    void merge_state(const nlohmann::json& state);
     nlohmann::json to_json();
     void to_table(boost::shared_ptr<boost::iostreams::filtering_ostream> metrics_table);
+    std::string make_problematic_read_sample_filename() const;
+    void write_problematic_read_samples(const std::string& filename);
 };
 
 
@@ -131,6 +489,7 @@ public:
     std::string programs = "";  // PG
 
     nlohmann::json to_json();
+    void from_json(const nlohmann::json& json);
 };
 
 std::ostream& operator<<(std::ostream& os, const Library& library);
@@ -142,7 +501,10 @@ private:
     std::string problematic_read_filename = "";
     boost::shared_ptr<boost::iostreams::filtering_ostream> problematic_read_stream = nullptr;
 
-    void log_problematic_read(const std::string& problem, const std::string& record = "");
+    ProblematicReadSample problematic_read_sample;
+
+    void log_problematic_read(const std::string& problem, const bam_hdr_t* header, const bam1_t* record);
+    void log_problematic_read(const std::string& problem, const std::string& text = "");
     void open_problematic_read_stream();
 
 public:
@@ -184,7 +546,13 @@ public:
     unsigned long long int maximum_proper_pair_fragment_size = 0;
     unsigned long long int reads_with_mate_too_distant = 0;
 
-    std::map<std::string, std::vector<unsigned long long int>> unlikely_fragment_sizes = {};
+    // The fragment sizes of improperly paired reads, and how many
+    // reads had each, to be judged against the largest proper
+    // fragment once every read has been seen. Only when logging
+    // problematic reads are their names kept too, and then outside
+    // memory as far as possible.
+    std::map<unsigned long long int, unsigned long long int> unlikely_fragment_sizes = {};
+    std::shared_ptr<NameValueSpill> unlikely_fragment_reads = nullptr;
 
     unsigned long long int total_autosomal_reads = 0;
     unsigned long long int total_mitochondrial_reads = 0;
@@ -193,21 +561,61 @@ public:
 
     unsigned long long int hqaa = 0;  // primary, properly paired and mapped to autosomal references
 
-    std::map<int, unsigned long long int> fragment_length_counts = {};
+    // only fragments up to 1000bp are reported; longer ones just overflow
+    Histogram<1001> fragment_length_counts;
 
-    std::map<std::string, unsigned long long int> chromosome_counts = {};
+    std::vector<unsigned long long int> chromosome_counts = {};  // HQAA by reference ID
 
     unsigned long long int hqaa_short_count = 0;
     unsigned long long int hqaa_mononucleosomal_count = 0;
 
-    std::map<int, unsigned long long int> mapq_counts = {};
+    Histogram<256> mapq_counts;
+
+    // The flags of reads whose flag counters (forward_reads through
+    // paired_reads) haven't been updated yet. They're counted a block
+    // at a time, and the last partial block by count_pending_flags
+    // once every read has been added.
+    static const size_t flag_block_size = 64;
+    uint16_t pending_flags[flag_block_size];
+    size_t pending_flag_count = 0;
 
     std::map<int, unsigned long long int> tss_coverage = {};
+
+    // Fragments' TSS coverage is accumulated as the changes in coverage
+    // at each base of the TSS window, so crediting a fragment is two
+    // increments however many bases it covers. The changes are summed
+    // into tss_coverage when the reads have all been added.
+    std::vector<long long int> tss_coverage_changes = {};
     std::map<int, double> tss_coverage_scaled = {};
     unsigned long long int tss_flanking_count = 0; // iterated for each base pair in the TSS flanking region (first and last 100 bp of the TSS extension) that overlaps each read. Used in the TSS enrichment calculation
     unsigned long long int tss_count = 0; // number of reads that overlap a TSS (the exact base pair)
     double tss_enrichment = 0.0;
 
+    // Each fragment near a TSS with an HQAA mate is credited to the
+    // TSS coverage once. Leftmost mates wait in tss_mates, by query
+    // name hash, for their partners. In a coordinate-sorted file, a
+    // mate is given up on once the reads pass its partner's position,
+    // which tss_mate_expiry orders them by, so only the mates within
+    // an insert size of the current read are held. In a file grouped
+    // by query name, either mate may come first, and a waiting mate is
+    // given up on as soon as another query's reads arrive, so at most
+    // one is held.
+    //
+    // Mates still waiting when a stretch of the file has been read
+    // are released: credited if HQAA, and noted in
+    // tss_fragments_credited. Rightmost HQAA mates whose partners
+    // weren't seen are deferred until every read has been added, so
+    // fragments split between chunks of the file can be reconciled
+    // in merge.
+    std::unordered_map<uint64_t, TSSMate> tss_mates = {};
+    std::priority_queue<std::pair<uint64_t, uint64_t>, std::vector<std::pair<uint64_t, uint64_t>>, std::greater<std::pair<uint64_t, uint64_t>>> tss_mate_expiry = {};
+    std::unordered_set<uint64_t> tss_fragments_credited = {};
+    std::unordered_map<uint64_t, TSSFragment> tss_fragments_deferred = {};
+    int32_t tss_cursor_tid = -1;
+    size_t tss_cursor = 0;
+    int64_t tss_cursor_position = 0;
+
+    unsigned int modules = ALL_METRICS;
     bool log_problematic_reads = false;
     bool peaks_requested = false;
     bool tss_requested = false;
@@ -216,11 +624,35 @@ public:
 
     Metrics(MetricsCollector* collector, const std::string& name = nullptr);
 
-    void add_alignment(const bam_hdr_t* header, const bam1_t* record);
+    // The per-record path is specialized at compile time for whether
+    // TSS coverage, peaks, problematic read logging and verbose output
+    // are wanted, and for which of the per-read metrics modules, so
+    // the usual run's loop has none of the others' branches. The
+    // specialization is chosen once, when the Metrics are constructed.
+    typedef void (Metrics::*AlignmentAdder)(const bam_hdr_t* header, const bam1_t* record);
+    template <bool TSS, bool Peaks, bool Logging, bool Verbose, unsigned int Modules>
+    void add_alignment_as(const bam_hdr_t* header, const bam1_t* record);
+    template <bool TSS, bool Peaks, bool Logging, bool Verbose>
+    static AlignmentAdder choose_module_adder(unsigned int modules);
+    AlignmentAdder alignment_adder = nullptr;
+    void choose_alignment_adder();
+
+    void add_alignment(const bam_hdr_t* header, const bam1_t* record) {
+        (this->*alignment_adder)(header, record);
+    }
+    void add_flag_counts(const uint16_t* flags, size_t count);
+    void count_pending_flags();
+    void merge(const Metrics& other);
     std::string configuration_string() const;
-    void add_tss_coverage(const Feature& fragment);
+    void add_tss_coverage(const bam_hdr_t* header, const bam1_t* record);
+    size_t find_tss_window(int32_t tid, int64_t start);
+    void credit_tss_coverage(int32_t tid, int64_t start, int64_t end, size_t first_window = SIZE_MAX);
+    void expire_tss_mates(uint64_t key);
+    void expire_other_tss_mates(uint64_t qname_hash);
+    void release_tss_mates();
+    void settle_tss_coverage();
+    void sum_tss_coverage_changes();
     void calculate_tss_metrics();
-    std::map<int, unsigned long long int> calculate_tss_metric_for_reference(const std::string &reference, const int extension, FeatureTree &fragment_tree);
 
     bool is_autosomal(const std::string &reference_name);
     bool is_mitochondrial(const std::string& reference_name);
@@ -231,12 +663,15 @@ public:
     bool is_hqaa(const bam_hdr_t* header, const bam1_t* record);
     void load_peaks();
     void make_aggregate_diagnoses();
+    const ProblematicReadSample& get_problematic_read_sample() const;
     std::string make_metrics_filename(const std::string& suffix);
     bool mapq_at_least(const int& mapq, const bam1_t* record);
     double mean_mapq() const;
     double median_mapq() const;
     double median_fragment_length() const;
     nlohmann::json to_json();
+    nlohmann::json state_to_json();
+    void load_state(const nlohmann::json& state);
 };
 
 std::ostream& operator<<(std::ostream& os, const Metrics& metrics);
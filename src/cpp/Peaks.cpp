@@ -87,17 +87,25 @@ void ReferencePeakCollection::add(const Peak& peak) {
 
 
 bool ReferencePeakCollection::overlaps(const Feature& feature) const {
-    return !peaks.empty() &&
-        reference == feature.reference && (
-            (
-                (start <= feature.start && feature.start <= end) ||
-                (start <= feature.end && feature.end <= end)
-            ) ||
-            (
-                (feature.start <= start && start <= feature.end) ||
-                (feature.start <= end && end <= feature.end)
-            )
-        );
+    return reference == feature.reference && overlaps(feature.start, feature.end);
+}
+
+
+///
+/// Check whether a span on this collection's reference falls within
+/// the extent of its peaks.
+///
+bool ReferencePeakCollection::overlaps(unsigned long long int feature_start, unsigned long long int feature_end) const {
+    return !peaks.empty() && (
+        (
+            (start <= feature_start && feature_start <= end) ||
+            (start <= feature_end && feature_end <= end)
+        ) ||
+        (
+            (feature_start <= start && start <= feature_end) ||
+            (feature_start <= end && end <= feature_end)
+        )
+    );
 }
 
 
@@ -107,6 +115,7 @@ void ReferencePeakCollection::sort() {
 
 
 void PeakTree::add(Peak& peak) {
+    reference_peaks_index = ReferencePeaksIndex();
     tree[peak.reference].add(peak);
     total_peak_territory += peak.size();
 }
@@ -122,15 +131,54 @@ ReferencePeakCollection* PeakTree::get_reference_peaks(const std::string& refere
 }
 
 
+///
+/// Note the alignment file's reference names, so that alignments can
+/// be recorded by reference ID.
+///
+void PeakTree::index_references(const std::vector<std::string>& names) {
+    reference_names = names;
+    reference_peaks_index = ReferencePeaksIndex();
+}
+
+
+ReferencePeakCollection* PeakTree::get_reference_peaks(int32_t tid) {
+    if (!reference_peaks_index.built) {
+        for (const auto& reference_name : reference_names) {
+            auto it = tree.find(reference_name);
+            reference_peaks_index.by_tid.push_back(it == tree.end() ? nullptr : &it->second);
+        }
+        reference_peaks_index.built = true;
+    }
+
+    return tid >= 0 && (size_t)tid < reference_peaks_index.by_tid.size() ? reference_peaks_index.by_tid[tid] : nullptr;
+}
+
+
 void PeakTree::record_alignment(const Feature& alignment, bool is_hqaa, bool is_duplicate) {
+    record_alignment(get_reference_peaks(alignment.reference), alignment.start, alignment.end, is_hqaa, is_duplicate);
+}
+
+
+void PeakTree::record_alignment(const Interval& alignment, bool is_hqaa, bool is_duplicate) {
+    record_alignment(get_reference_peaks(alignment.tid), alignment.start, alignment.end, is_hqaa, is_duplicate);
+}
+
+
+void PeakTree::record_alignment(ReferencePeakCollection* rpc, unsigned long long int alignment_start, unsigned long long int alignment_end, bool is_hqaa, bool is_duplicate) {
     bool alignment_overlaps_peak = false;
-    ReferencePeakCollection* rpc = get_reference_peaks(alignment.reference);
-    if (rpc->overlaps(alignment)) {
-        auto peak = std::lower_bound(rpc->peaks.begin(), rpc->peaks.end(), alignment, feature_overlap_comparator);
-        auto end = std::upper_bound(peak, rpc->peaks.end(), alignment, feature_overlap_comparator);
+    if (rpc != nullptr && rpc->overlaps(alignment_start, alignment_end)) {
+        // the peaks are sorted, so those overlapping the alignment
+        // are those that neither end before it starts nor start
+        // after it ends
+        auto peak = std::lower_bound(rpc->peaks.begin(), rpc->peaks.end(), alignment_start, [](const Peak& p, unsigned long long int start) {
+            return p.end < start;
+        });
+        auto end = std::upper_bound(peak, rpc->peaks.end(), alignment_end, [](unsigned long long int end, const Peak& p) {
+            return end < p.start;
+        });
 
         for (; peak != end; peak++) {
-            if (peak->overlaps(alignment)) {
+            if (peak->overlaps(alignment_start, alignment_end)) {
                 alignment_overlaps_peak = true;
 
                 if (is_hqaa) {
@@ -157,6 +205,98 @@ void PeakTree::record_alignment(const Feature& alignment, bool is_hqaa, bool is_
 }
 
 
+///
+/// Add the alignment counts recorded in another tree holding the same
+/// peaks, as when several threads have each measured part of a file.
+///
+void PeakTree::merge(const PeakTree& other) {
+    for (const auto& other_reference_peaks : other.tree) {
+        const std::vector<Peak>& other_peaks = other_reference_peaks.second.peaks;
+        if (other_peaks.empty()) {
+            continue;
+        }
+
+        std::vector<Peak>& peaks = tree[other_reference_peaks.first].peaks;
+        if (peaks.size() != other_peaks.size()) {
+            throw std::out_of_range("Cannot merge peaks for reference " + other_reference_peaks.first + ": the peak lists differ.");
+        }
+
+        for (size_t i = 0; i < peaks.size(); i++) {
+            peaks[i].overlapping_hqaa += other_peaks[i].overlapping_hqaa;
+        }
+    }
+
+    duplicates_in_peaks += other.duplicates_in_peaks;
+    duplicates_not_in_peaks += other.duplicates_not_in_peaks;
+    ppm_in_peaks += other.ppm_in_peaks;
+    ppm_not_in_peaks += other.ppm_not_in_peaks;
+    hqaa_in_peaks += other.hqaa_in_peaks;
+}
+
+
+///
+/// Save the peaks and their alignment counts, keeping each
+/// reference's peaks in the order they were loaded, so that trees
+/// restored from the saved state can be merged.
+///
+nlohmann::json PeakTree::state_to_json() const {
+    nlohmann::json references = nlohmann::json::object();
+    for (const auto& reference_peaks : tree) {
+        if (reference_peaks.second.peaks.empty()) {
+            continue;
+        }
+
+        nlohmann::json peaks = nlohmann::json::array();
+        for (const auto& peak : reference_peaks.second.peaks) {
+            peaks.push_back({peak.start, peak.end, peak.name, peak.overlapping_hqaa});
+        }
+        references[reference_peaks.first] = peaks;
+    }
+
+    return {
+        {"references", references},
+        {"duplicates_in_peaks", duplicates_in_peaks},
+        {"duplicates_not_in_peaks", duplicates_not_in_peaks},
+        {"ppm_in_peaks", ppm_in_peaks},
+        {"ppm_not_in_peaks", ppm_not_in_peaks},
+        {"hqaa_in_peaks", hqaa_in_peaks}
+    };
+}
+
+
+void PeakTree::load_state(const nlohmann::json& state) {
+    tree.clear();
+    reference_peaks_index = ReferencePeaksIndex();
+    total_peak_territory = 0;
+
+    for (auto reference_peaks = state["references"].begin(); reference_peaks != state["references"].end(); reference_peaks++) {
+        ReferencePeakCollection& collection = tree[reference_peaks.key()];
+        collection.reference = reference_peaks.key();
+
+        for (const auto& peak_state : reference_peaks.value()) {
+            Peak peak(collection.reference, peak_state[0].get<unsigned long long int>(), peak_state[1].get<unsigned long long int>(), peak_state[2].get<std::string>());
+            peak.overlapping_hqaa = peak_state[3];
+
+            // already sorted when saved
+            collection.peaks.push_back(peak);
+            if (collection.start == 0 || collection.start > peak.start) {
+                collection.start = peak.start;
+            }
+            if (collection.end == 0 || collection.end < peak.end) {
+                collection.end = peak.end;
+            }
+            total_peak_territory += peak.size();
+        }
+    }
+
+    duplicates_in_peaks = state["duplicates_in_peaks"];
+    duplicates_not_in_peaks = state["duplicates_not_in_peaks"];
+    ppm_in_peaks = state["ppm_in_peaks"];
+    ppm_not_in_peaks = state["ppm_not_in_peaks"];
+    hqaa_in_peaks = state["hqaa_in_peaks"];
+}
+
+
 void PeakTree::determine_top_peaks() {
     unsigned long long int count = 0;
     unsigned long long int cumulative_hqaa_in_peaks = 0;
@@ -10,6 +10,8 @@
 #include <iostream>
 #include <string>
 
+#include "json.hpp"
+
 #include "Features.hpp"
 #include "Utils.hpp"
 
@@ -36,6 +38,7 @@ public:
 
     void add(const Peak& peak);
     bool overlaps(const Feature& feature) const;
+    bool overlaps(unsigned long long int feature_start, unsigned long long int feature_end) const;
     void sort();
 };
 
@@ -44,6 +47,27 @@ class PeakTree {
 private:
     std::map<std::string, ReferencePeakCollection, numeric_string_comparator> tree = {};
 
+    // The alignment file's reference names, by ID, and the peaks on
+    // each, or null where there are none. The pointers are into this
+    // tree, so a copied tree starts without them and looks them up
+    // again when first needed.
+    std::vector<std::string> reference_names = {};
+    struct ReferencePeaksIndex {
+        std::vector<ReferencePeakCollection*> by_tid = {};
+        bool built = false;
+
+        ReferencePeaksIndex() {}
+        ReferencePeaksIndex(const ReferencePeaksIndex&) {}
+        ReferencePeaksIndex& operator=(const ReferencePeaksIndex&) {
+            by_tid.clear();
+            built = false;
+            return *this;
+        }
+    } reference_peaks_index;
+
+    ReferencePeakCollection* get_reference_peaks(int32_t tid);
+    void record_alignment(ReferencePeakCollection* rpc, unsigned long long int alignment_start, unsigned long long int alignment_end, bool is_hqaa, bool is_duplicate);
+
 public:
     unsigned long long int total_peak_territory = 0;
 
@@ -63,8 +87,13 @@ public:
     void add(Peak& peak);
     void determine_top_peaks();
     bool empty();
+    void merge(const PeakTree& other);
+    nlohmann::json state_to_json() const;
+    void load_state(const nlohmann::json& state);
     ReferencePeakCollection* get_reference_peaks(const std::string& reference_name);
+    void index_references(const std::vector<std::string>& names);
     void record_alignment(const Feature& aligment, bool is_hqaa, bool is_duplicate);
+    void record_alignment(const Interval& alignment, bool is_hqaa, bool is_duplicate);
     std::vector<Peak> list_peaks();
     std::vector<Peak> list_peaks_by_overlapping_hqaa_descending();
     std::vector<Peak> list_peaks_by_size_descending();
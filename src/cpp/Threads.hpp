@@ -0,0 +1,52 @@
+//
+// Copyright 2015 Stephen Parker
+//
+// Licensed under Version 3 of the GPL or any later version
+//
+
+#ifndef THREADS_HPP
+#define THREADS_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+
+///
+/// A blocking first-in, first-out queue holding at most a fixed
+/// number of items. Producers wait when it's full and consumers wait
+/// when it's empty, which keeps a fast producer from running
+/// arbitrarily far ahead of its consumers.
+///
+template <typename T>
+class BoundedQueue {
+private:
+    std::deque<T> items = {};
+    size_t capacity;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    void push(const T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return items.size() < capacity; });
+        items.push_back(item);
+        lock.unlock();
+        not_empty.notify_one();
+    }
+
+    T pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return !items.empty(); });
+        T item = items.front();
+        items.pop_front();
+        lock.unlock();
+        not_full.notify_one();
+        return item;
+    }
+};
+
+#endif  // THREADS_HPP
@@ -6,6 +6,7 @@
 
 #include <algorithm>
 #include <cerrno>
+#include <cstdio>
 #include <fstream>
 #include <getopt.h>
 #include <iomanip>
@@ -13,6 +14,7 @@
 #include <numeric>
 #include <set>
 #include <sstream>
+#include <stdexcept>
 #include <stdlib.h>
 
 #include <boost/filesystem.hpp>
@@ -30,14 +32,21 @@ enum {
     OPT_VERSION,
 
     OPT_THREADS,
+    OPT_SHARD,
+    OPT_MARK_DUPLICATES,
+    OPT_MARKED_ALIGNMENT_FILE,
+    OPT_METRICS,
+    OPT_LEAN_BAM_READING,
 
     OPT_PEAK_FILE,
     OPT_TSS_FILE,
     OPT_TSS_EXTENSION,
+    OPT_REFERENCE,
     OPT_EXCLUDED_REGION_FILE,
 
     OPT_METRICS_FILE,
     OPT_LOG_PROBLEMATIC_READS,
+    OPT_PROBLEMATIC_READ_SAMPLE,
     OPT_TABULAR_OUTPUT,
     OPT_LESS_REDUNDANT,
 
@@ -67,7 +76,9 @@ void print_usage() {
               << "where:" << std::endl
               << "    organism is the subject of the experiment, which determines the list of autosomes"  << std::endl
               << "    (see \"Reference Genome Configuration\" below)."  << std::endl  << std::endl
-              << "    alignment-file is a BAM file with duplicate reads marked." << std::endl
+              << "    alignment-file is a BAM or CRAM file with duplicate reads marked. It needn't be sorted or" << std::endl
+              << "    indexed; if it's grouped by read name (the header has SO:queryname or GO:query), mates" << std::endl
+              << "    are paired as they're read, so name-collated aligner output can be used directly." << std::endl
 
               << std::endl
 
@@ -77,7 +88,24 @@ void print_usage() {
               << "--help: show this usage message." << std::endl
               << "--verbose: show more details and progress updates." << std::endl
               << "--version: print the version of the program." << std::endl
-              << "--threads <n>: the maximum number of threads to use (right now, only for calculating TSS enrichment)." << std::endl << std::endl
+              << "--threads <n>: the maximum number of threads to use for reading alignments." << std::endl
+              << "    An indexed, coordinate-sorted BAM file is split into chunks read in parallel." << std::endl
+              << "--shard <i>/<n>: measure only the i-th of n slices of the references, and write the raw" << std::endl
+              << "    measurements to the metrics file (by default named after the BAM file, with the suffix" << std::endl
+              << "    \".ataqv.shard-<i>-of-<n>.json\"). Run all n shards, then combine them with \"ataqv merge\"." << std::endl
+              << "--mark-duplicates: ignore the duplicate flags in the alignment file, which must be" << std::endl
+              << "    coordinate-sorted, and mark duplicate fragments as it's read instead, so it needn't be" << std::endl
+              << "    run through Picard MarkDuplicates first. The first fragment seen at a position is kept." << std::endl
+              << "--marked-alignment-file \"file name\": with --mark-duplicates, also write the alignments," << std::endl
+              << "    with duplicates marked, to this BAM file. Can't be used with --shard." << std::endl
+              << "--lean-bam-reading: read BAM records with only their fixed-size fields decoded, skipping" << std::endl
+              << "    htslib's per-record CIGAR checks. Faster, but trusts the BAM file to be well formed." << std::endl
+              << "--metrics <list>: collect only these of the optional metrics, as a comma-separated list of" << std::endl
+              << "    fragment-length, mapq, chromosomes, peaks, tss and improper (the diagnosis of improperly" << std::endl
+              << "    paired reads), or all, the default. The read counts are always collected; the others" << std::endl
+              << "    cost nothing when left out, and peak or TSS files are then ignored. The metrics of the" << std::endl
+              << "    modules left out are reported as null, including the short and mononucleosomal" << std::endl
+              << "    fragment counts without fragment-length." << std::endl << std::endl
 
               << "Optional Input" << std::endl
               << "--------------" << std::endl << std::endl
@@ -89,10 +117,14 @@ void print_usage() {
               << "    appended. If you specify a single filename instead of \"auto\" with read groups, the " << std::endl
               << "    same peaks will be used for all reads -- be sure this is what you want." << std::endl << std::endl
 
+              << "--reference \"file name\"" << std::endl
+              << "    The FASTA file of the reference a CRAM alignment file was compressed against, if it" << std::endl
+              << "    can't be found through the CRAM header. Only the fields the metrics need are decoded" << std::endl
+              << "    from a CRAM file, so it's rarely read." << std::endl << std::endl
+
               << "--tss-file \"file name\"" << std::endl
               << "    A BED file of transcription start sites for the experiment organism. If supplied," << std::endl
-              << "    a TSS enrichment score will be calculated according to the ENCODE data standards." << std::endl
-              << "    This calculation requires that the BAM file of alignments be indexed." << std::endl << std::endl
+              << "    a TSS enrichment score will be calculated according to the ENCODE data standards." << std::endl << std::endl
 
               << "--tss-extension \"size\"" << std::endl
               << "    If a TSS enrichment score is requested, it will be calculated for a region of " << std::endl
@@ -114,7 +146,16 @@ void print_usage() {
               << "--log-problematic-reads" << std::endl
               << "    If given, problematic reads will be logged to a file per read group, with names" << std::endl
               << "    derived from the read group IDs, with \".problems\" appended. If no read groups" << std::endl
-              << "    are found, the reads will be written to one file named after the BAM file." << std::endl << std::endl
+              << "    are found, the reads will be written to one file named after the BAM file. With" << std::endl
+              << "    --shard, the names end in \".shard-<i>-of-<n>.problems\" instead." << std::endl << std::endl
+
+              << "--problematic-read-sample <k>" << std::endl
+              << "    Log problematic reads, but keep only a random sample of at most k reads with each" << std::endl
+              << "    problem per read group or nucleus, along with the exact number of reads with each" << std::endl
+              << "    problem. Everything is written to one BGZF-compressed file named after the BAM file" << std::endl
+              << "    (or --name), with \".problems.gz\" appended, whose first column is the read group" << std::endl
+              << "    or nucleus. Lines starting with '#' hold the counts. With --shard, the name ends in" << std::endl
+              << "    \".shard-<i>-of-<n>.problems.gz\" instead." << std::endl << std::endl
 
               << "--tabular-output" << std::endl
               << "    If given, the metrics file output will be a tabular (TSV) text file, not JSON. This " << std::endl
@@ -205,7 +246,18 @@ void print_usage() {
               << "--mitochondrial-reference-name \"name\"" << std::endl
               << "    If the reference name for mitochondrial DNA in your alignment file is not \"chrM\",." << std::endl
               << "    use this option to supply the correct name. Again, if this name is wrong, all the"<< std::endl
-              << "    measurements involving mitochondrial alignments will be wrong." << std::endl << std::endl;
+              << "    measurements involving mitochondrial alignments will be wrong." << std::endl << std::endl
+
+              << std::endl
+
+              << "Merging Shards" << std::endl
+              << "--------------" << std::endl << std::endl
+
+              << "ataqv merge [--verbose] [--metrics-file \"file name\"] [--tabular-output] shard-file..." << std::endl << std::endl
+
+              << "    Combine the files written by runs with --shard into the metrics that a single run" << std::endl
+              << "    over the whole alignment file would have produced. The metrics file options work" << std::endl
+              << "    as above; by default the metrics are written to a file named after the BAM file." << std::endl << std::endl;
 }
 
 
@@ -229,12 +281,146 @@ void print_error(T t, Args... args)
 }
 
 
+///
+/// Combine the states written by --shard runs into the usual output.
+///
+int merge_shards(int argc, char **argv) {
+    int c, option_index = 0;
+    bool verbose = false;
+    bool tabular_output = false;
+    std::string metrics_filename;
+    boost::shared_ptr<boost::iostreams::filtering_ostream> metrics_file;
+
+    static struct option long_options[] = {
+        {"help", no_argument, nullptr, OPT_HELP},
+        {"verbose", no_argument, nullptr, OPT_VERBOSE},
+        {"metrics-file", required_argument, nullptr, OPT_METRICS_FILE},
+        {"tabular-output", no_argument, nullptr, OPT_TABULAR_OUTPUT},
+        {0, 0, 0, 0}
+    };
+
+    while ((c = getopt_long(argc, argv, "", long_options, &option_index)) != -1) {
+        switch (c) {
+        case OPT_VERBOSE:
+            verbose = true;
+            break;
+        case OPT_METRICS_FILE:
+            metrics_filename = optarg;
+            break;
+        case OPT_TABULAR_OUTPUT:
+            tabular_output = true;
+            break;
+        default:
+            print_usage();
+            exit(1);
+        }
+    }
+
+    if (optind >= argc) {
+        print_error("ERROR: Please specify the shard files to merge.");
+        exit(1);
+    }
+
+    try {
+        std::vector<nlohmann::json> states;
+        for (int i = optind; i < argc; i++) {
+            std::string state_filename = argv[i];
+            boost::shared_ptr<boost::iostreams::filtering_istream> state_file;
+            try {
+                state_file = mistream(state_filename);
+            } catch (FileException& e) {
+                throw FileException("Could not open shard file \"" + state_filename + "\": " + e.what());
+            }
+
+            if (verbose) {
+                std::cout << "Reading shard file " << state_filename << "." << std::endl;
+            }
+
+            nlohmann::json state;
+            try {
+                *state_file >> state;
+            } catch (std::invalid_argument& e) {
+                throw FileException("Could not parse shard file \"" + state_filename + "\": " + e.what());
+            }
+
+            try {
+                MetricsCollector::check_state(state);
+            } catch (FileException& e) {
+                throw FileException("Could not use shard file \"" + state_filename + "\": " + e.what());
+            }
+            states.push_back(state);
+        }
+
+        MetricsCollector collector = MetricsCollector::from_state(states[0], verbose);
+
+        std::set<int> shards_seen;
+        for (const auto& state : states) {
+            int shard_index = state["shard_index"];
+            if (state["shard_count"] != states[0]["shard_count"] || shards_seen.count(shard_index) > 0) {
+                throw FileException("The shard files must be the distinct shards of one run.");
+            }
+            shards_seen.insert(shard_index);
+            collector.merge_state(state);
+        }
+
+        if ((int)shards_seen.size() != states[0]["shard_count"].get<int>()) {
+            std::cerr << "WARNING: Only " << shards_seen.size() << " of " << states[0]["shard_count"] << " shards were given; the metrics will be incomplete." << std::endl;
+        }
+
+        collector.finalize();
+
+        if (metrics_filename.empty()) {
+            metrics_filename = basename(collector.alignment_filename);
+            metrics_filename += ".ataqv.json";
+        }
+
+        try {
+            metrics_file = mostream(metrics_filename);
+        } catch (FileException& e) {
+            print_error("ERROR: Could not open metrics file \"" + metrics_filename + "\" for writing: " + e.what());
+            exit(1);
+        }
+
+        std::cout << collector << std::endl;  // Print the metrics
+
+        if (!tabular_output) {
+            std::cout << "Writing JSON metrics to " << metrics_filename << std::endl << std::flush;
+            *metrics_file << std::setw(2) << collector.to_json();
+        } else {
+            std::cout << "Writing tabular metrics to " << metrics_filename << std::endl << std::flush;
+            collector.to_table(metrics_file);
+        }
+        std::cout << "Metrics written to \"" << metrics_filename << "\"" << std::endl;
+    } catch (FileException& e) {
+        print_error("ERROR: " + std::string(e.what()));
+        exit(1);
+    } catch (std::domain_error& e) {
+        print_error("ERROR: The shard files hold values of the wrong type: " + std::string(e.what()));
+        exit(1);
+    }
+
+    std::cout << "Finished." << std::endl << std::flush;
+    return 0;
+}
+
+
 int main(int argc, char **argv) {
 
+    if (argc > 1 && std::string(argv[1]) == "merge") {
+        return merge_shards(argc - 1, argv + 1);
+    }
+
     int c, option_index = 0;
     bool verbose = false;
     int thread_limit = 1;
+    int shard_index = 1;
+    int shard_count = 1;
+    bool mark_duplicates = false;
+    std::string marked_alignment_filename;
+    unsigned int metrics_modules = ALL_METRICS;
+    bool lean_bam_reading = false;
     bool log_problematic_reads = false;
+    size_t problematic_read_sample_size = 0;
     bool tabular_output = false;
     bool less_redundant = false;
 
@@ -254,6 +440,7 @@ int main(int argc, char **argv) {
     std::string peak_filename;
     std::string tss_filename;
     int tss_extension = 1000;
+    std::string reference_filename;
     std::vector<std::string> excluded_region_filenames;
 
     std::string metrics_filename;
@@ -264,7 +451,13 @@ int main(int argc, char **argv) {
         {"verbose", no_argument, nullptr, OPT_VERBOSE},
         {"version", no_argument, nullptr, OPT_VERSION},
         {"threads", required_argument, nullptr, OPT_THREADS},
+        {"shard", required_argument, nullptr, OPT_SHARD},
+        {"mark-duplicates", no_argument, nullptr, OPT_MARK_DUPLICATES},
+        {"marked-alignment-file", required_argument, nullptr, OPT_MARKED_ALIGNMENT_FILE},
+        {"metrics", required_argument, nullptr, OPT_METRICS},
+        {"lean-bam-reading", no_argument, nullptr, OPT_LEAN_BAM_READING},
         {"log-problematic-reads", no_argument, nullptr, OPT_LOG_PROBLEMATIC_READS},
+        {"problematic-read-sample", required_argument, nullptr, OPT_PROBLEMATIC_READ_SAMPLE},
         {"tabular-output", no_argument, nullptr, OPT_TABULAR_OUTPUT},
         {"less-redundant", no_argument, nullptr, OPT_LESS_REDUNDANT},
         {"name", required_argument, nullptr, OPT_NAME},
@@ -278,6 +471,7 @@ int main(int argc, char **argv) {
         {"peak-file", required_argument, nullptr, OPT_PEAK_FILE},
         {"tss-file", required_argument, nullptr, OPT_TSS_FILE},
         {"tss-extension", required_argument, nullptr, OPT_TSS_EXTENSION},
+        {"reference", required_argument, nullptr, OPT_REFERENCE},
         {"autosomal-reference-file", required_argument, nullptr, OPT_AUTOSOMAL_REFERENCE_FILE},
         {"mitochondrial-reference-name", required_argument, nullptr, OPT_MITOCHONDRIAL_REFERENCE_NAME},
         {0, 0, 0, 0}
@@ -298,9 +492,40 @@ int main(int argc, char **argv) {
         case OPT_THREADS:
             thread_limit = std::stoi(optarg);
             break;
+        case OPT_SHARD:
+            if (sscanf(optarg, "%d/%d", &shard_index, &shard_count) != 2 || shard_count < 1 || shard_index < 1 || shard_index > shard_count) {
+                print_error("ERROR: Please give the shard as <i>/<n>, with i between 1 and n.");
+                exit(1);
+            }
+            break;
+        case OPT_MARK_DUPLICATES:
+            mark_duplicates = true;
+            break;
+        case OPT_MARKED_ALIGNMENT_FILE:
+            marked_alignment_filename = optarg;
+            break;
+        case OPT_LEAN_BAM_READING:
+            lean_bam_reading = true;
+            break;
+        case OPT_METRICS:
+            try {
+                metrics_modules = parse_metrics_modules(optarg);
+            } catch (std::invalid_argument& e) {
+                print_error("ERROR: " + std::string(e.what()) + " Please give --metrics a comma-separated list of fragment-length, mapq, chromosomes, peaks, tss, improper or all.");
+                exit(1);
+            }
+            break;
         case OPT_LOG_PROBLEMATIC_READS:
             log_problematic_reads = true;
             break;
+        case OPT_PROBLEMATIC_READ_SAMPLE:
+            if (std::stoi(optarg) < 1) {
+                print_error("ERROR: Please give a problematic read sample size of at least 1.");
+                exit(1);
+            }
+            problematic_read_sample_size = std::stoi(optarg);
+            log_problematic_reads = true;
+            break;
         case OPT_TABULAR_OUTPUT:
             tabular_output = true;
             break;
@@ -341,6 +566,9 @@ int main(int argc, char **argv) {
         case OPT_TSS_EXTENSION:
             tss_extension = std::stoi(optarg);
             break;
+        case OPT_REFERENCE:
+            reference_filename = optarg;
+            break;
         case OPT_AUTOSOMAL_REFERENCE_FILE:
             autosomal_reference_filename = optarg;
             break;
@@ -360,6 +588,17 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    if (!marked_alignment_filename.empty()) {
+        if (!mark_duplicates) {
+            print_error("ERROR: A marked alignment file can only be written with --mark-duplicates.");
+            exit(1);
+        }
+        if (shard_count > 1) {
+            print_error("ERROR: A marked alignment file can't be written from a shard.");
+            exit(1);
+        }
+    }
+
     organism = argv[optind];
     alignment_filename = argv[optind + 1];
 
@@ -401,11 +640,19 @@ int main(int argc, char **argv) {
             less_redundant,
             excluded_region_filenames);
 
+        collector.shard_index = shard_index;
+        collector.shard_count = shard_count;
+        collector.problematic_read_sample_size = problematic_read_sample_size;
+        collector.mark_duplicates = mark_duplicates;
+        collector.marked_alignment_filename = marked_alignment_filename;
+        collector.metrics_modules = metrics_modules;
+        collector.lean_bam_reading = lean_bam_reading;
+        collector.reference_filename = reference_filename;
+
         // if the filename for the metrics output wasn't specified,
         // construct it from the source BAM filename
         if (metrics_filename.empty()) {
-            metrics_filename = basename(alignment_filename);
-            metrics_filename += ".ataqv.json";
+            metrics_filename = basename(alignment_filename) + ".ataqv" + collector.shard_suffix() + ".json";
         }
 
         try {
@@ -426,6 +673,14 @@ int main(int argc, char **argv) {
 
         collector.load_alignments();
 
+        if (shard_count > 1) {
+            std::cout << "Writing shard " << shard_index << " of " << shard_count << " to " << metrics_filename << std::endl << std::flush;
+            *metrics_file << collector.state_to_json();
+            std::cout << "Shard written to \"" << metrics_filename << "\"" << std::endl;
+            std::cout << "Finished." << std::endl << std::flush;
+            return 0;
+        }
+
         std::cout << collector << std::endl;  // Print the metrics
 
         if (!tabular_output) {
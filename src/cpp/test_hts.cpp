@@ -1,7 +1,10 @@
+#include <cstring>
 #include <iostream>
+#include <vector>
 
 #include "catch.hpp"
 
+#include "Flags.hpp"
 #include "HTS.hpp"
 
 
@@ -48,6 +51,24 @@ TEST_CASE("Test HTS file handling") {
     SECTION("TEST HTS::record_to_string", "[hts/record_to_string]") {
         REQUIRE("SRR891268.122333488\t83\tchr20\t60087\t60\t50M\t=\t60058\t-79\tAGGAAGGAGAGAGTGAAGGAACTGCCAGGTGACACACTCCCACCATGGAC\tJJJJJJJJJJJJJJJJJIHHGIGIIIJJJJJIIGGIJHHHHHFFFFFCBB\tMD:Z:50\tPG:Z:MarkDuplicates\tNM:i:0\tAS:i:50\tXS:i:23" == record_to_string(header, record));
     }
+
+    SECTION("TEST HTS::get_string_tags", "[hts/get_string_tags]") {
+        const char* first = nullptr;
+        const char* second = nullptr;
+
+        get_string_tags(record, "PG", &first, "MD", &second);
+        REQUIRE(std::string("MarkDuplicates") == first);
+        REQUIRE(std::string("50") == second);
+
+        // NM is an integer, and there's no RG
+        get_string_tags(record, "NM", &first, "RG", &second);
+        REQUIRE(first == nullptr);
+        REQUIRE(second == nullptr);
+
+        get_string_tags(record, "MD", &first, "MD", &second);
+        REQUIRE(std::string("50") == first);
+        REQUIRE(std::string("50") == second);
+    }
 }
 
 
@@ -166,6 +187,197 @@ TEST_CASE("Test SAM header parsing", "[hts/parse_sam_header]") {
     REQUIRE(references.size() == 84);
 }
 
+TEST_CASE("Test coordinate sort keys", "[hts/coordinate_sort_key]") {
+    REQUIRE(coordinate_sort_key(0, 0) < coordinate_sort_key(0, 1));
+    REQUIRE(coordinate_sort_key(0, -1) < coordinate_sort_key(0, 0));
+    REQUIRE(coordinate_sort_key(0, 249250620) < coordinate_sort_key(1, 0));
+    REQUIRE(coordinate_sort_key(83, 0) < coordinate_sort_key(-1, -1));
+}
+
+TEST_CASE("Test query grouping", "[hts/is_query_grouped]") {
+    sam_header sorted = parse_sam_header("@HD\tVN:1.6\tSO:coordinate\n");
+    REQUIRE(is_coordinate_sorted(sorted));
+    REQUIRE(!is_query_grouped(sorted));
+
+    sam_header name_sorted = parse_sam_header("@HD\tVN:1.6\tSO:queryname\n");
+    REQUIRE(is_query_grouped(name_sorted));
+
+    sam_header collated = parse_sam_header("@HD\tVN:1.6\tSO:unsorted\tGO:query\n");
+    REQUIRE(!is_coordinate_sorted(collated));
+    REQUIRE(is_query_grouped(collated));
+
+    sam_header unknown = parse_sam_header("@SQ\tSN:chr1\tLN:100000\n");
+    REQUIRE(!is_query_grouped(unknown));
+}
+
+TEST_CASE("Test lean BAM reading", "[hts/read_bam_record]") {
+    for (const char* filename : {"test.bam", "SRR891275.bam"}) {
+        samFile* expected_file = sam_open(filename, "r");
+        bam_hdr_t* expected_header = sam_hdr_read(expected_file);
+        bam1_t* expected = bam_init1();
+
+        samFile* lean_file = sam_open(filename, "r");
+        bam_hdr_t* lean_header = sam_hdr_read(lean_file);
+        bam1_t* lean = bam_init1();
+
+        size_t records = 0;
+        while (sam_read1(expected_file, expected_header, expected) >= 0) {
+            REQUIRE(read_bam_record(lean_file->fp.bgzf, lean) >= 0);
+
+            REQUIRE(lean->core.tid == expected->core.tid);
+            REQUIRE(lean->core.pos == expected->core.pos);
+            REQUIRE(lean->core.qual == expected->core.qual);
+            REQUIRE(lean->core.l_qname == expected->core.l_qname);
+            REQUIRE(lean->core.flag == expected->core.flag);
+            REQUIRE(lean->core.n_cigar == expected->core.n_cigar);
+            REQUIRE(lean->core.l_qseq == expected->core.l_qseq);
+            REQUIRE(lean->core.mtid == expected->core.mtid);
+            REQUIRE(lean->core.mpos == expected->core.mpos);
+            REQUIRE(lean->core.isize == expected->core.isize);
+            REQUIRE(lean->l_data == expected->l_data);
+            REQUIRE(memcmp(lean->data, expected->data, lean->l_data) == 0);
+            REQUIRE(bam_endpos(lean) == bam_endpos(expected));
+            records++;
+        }
+        REQUIRE(records > 0);
+        REQUIRE(read_bam_record(lean_file->fp.bgzf, lean) == -1);
+
+        bam_destroy1(lean);
+        bam_hdr_destroy(lean_header);
+        hts_close(lean_file);
+        bam_destroy1(expected);
+        bam_hdr_destroy(expected_header);
+        hts_close(expected_file);
+    }
+}
+
+TEST_CASE("Test duplicate marking", "[hts/DuplicateMarker]") {
+    std::string sam(
+        "data:,@SQ\tSN:chr1\tLN:100000\n"
+        "A\t99\tchr1\t101\t60\t10M\t=\t201\t110\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "B\t1123\tchr1\t101\t60\t10M\t=\t201\t110\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "C\t99\tchr1\t101\t60\t10M\t=\t211\t120\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "S\t0\tchr1\t151\t60\t10M\t*\t0\t0\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "T\t0\tchr1\t151\t60\t10M\t*\t0\t0\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "A\t147\tchr1\t201\t60\t10M\t=\t101\t-110\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "B\t147\tchr1\t201\t60\t10M\t=\t101\t-110\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "C\t147\tchr1\t211\t60\t10M\t=\t101\t-120\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "U\t0\tchr1\t5001\t60\t10M\t*\t0\t0\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "A\t0\tchr1\t5001\t60\t10M\t*\t0\t0\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+    );
+
+    samFile* in = sam_open(sam.c_str(), "r");
+    bam_hdr_t* header = sam_hdr_read(in);
+    bam1_t* record = bam_init1();
+
+    DuplicateMarker marker;
+    DuplicateMarker library_marker;
+    std::vector<bool> expected = {false, true, false, false, true, false, true, false, false, true};
+    std::vector<bool> expected_by_library = {false, false, false, false, false, false, false, false, false, false};
+
+    for (size_t i = 0; sam_read1(in, header, record) >= 0; i++) {
+        // B was already marked, but it's the marker's call
+        REQUIRE(marker.mark(record, 0) == expected[i]);
+        REQUIRE(((record->core.flag & BAM_FDUP) != 0) == expected[i]);
+
+        // in its own library, nothing duplicates anything
+        REQUIRE(library_marker.mark(record, i) == expected_by_library[i]);
+    }
+
+    REQUIRE(marker.duplicates == 4);
+    REQUIRE(library_marker.duplicates == 0);
+
+    bam_destroy1(record);
+    bam_hdr_destroy(header);
+    hts_close(in);
+}
+
+
+TEST_CASE("Test duplicate marking across references", "[hts/DuplicateMarker]") {
+    std::string sam(
+        "data:,@SQ\tSN:chr1\tLN:100000\n@SQ\tSN:chr2\tLN:100000\n"
+        "A\t97\tchr1\t101\t60\t10M\tchr2\t501\t0\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "B\t97\tchr1\t101\t60\t10M\tchr2\t501\t0\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "C\t97\tchr1\t301\t60\t10M\tchr2\t501\t0\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "B\t145\tchr2\t501\t60\t10M\tchr1\t101\t0\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "A\t145\tchr2\t501\t60\t10M\tchr1\t101\t0\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "C\t145\tchr2\t501\t60\t10M\tchr1\t301\t0\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+    );
+
+    samFile* in = sam_open(sam.c_str(), "r");
+    bam_hdr_t* header = sam_hdr_read(in);
+    bam1_t* record = bam_init1();
+
+    // A was kept on chr1, but by the time its mate comes up on chr2,
+    // the signature is long gone, and B's mate is seen first
+    DuplicateMarker marker;
+    std::vector<bool> expected = {false, true, false, false, true, false};
+
+    for (size_t i = 0; sam_read1(in, header, record) >= 0; i++) {
+        REQUIRE(marker.mark(record, 0) == expected[i]);
+    }
+
+    REQUIRE(marker.duplicates == 2);
+
+    bam_destroy1(record);
+    bam_hdr_destroy(header);
+    hts_close(in);
+}
+
+
+TEST_CASE("Test flag classification", "[hts/classify_flag]") {
+    bam1_t record = {};
+    bam1_t* bam = &record;
+    std::vector<uint16_t> flags;
+    unsigned long long int expected_totals[FLAG_COUNTER_COUNT] = {};
+
+    for (uint16_t flag = 0; flag < 4096; flag++) {
+        bam->core.flag = flag;
+        flags.push_back(flag);
+
+        uint32_t counters = classify_flag(flag) & FLAG_COUNTERS_MASK;
+        REQUIRE(bool(counters & (1u << FORWARD_COUNTER)) == !IS_REVERSE(bam));
+        REQUIRE(bool(counters & (1u << REVERSE_COUNTER)) == bool(IS_REVERSE(bam)));
+        REQUIRE(bool(counters & (1u << SECONDARY_COUNTER)) == bool(IS_SECONDARY(bam)));
+        REQUIRE(bool(counters & (1u << SUPPLEMENTARY_COUNTER)) == bool(IS_SUPPLEMENTARY(bam)));
+        REQUIRE(bool(counters & (1u << DUPLICATE_COUNTER)) == bool(IS_DUP(bam)));
+        REQUIRE(bool(counters & (1u << FIRST_COUNTER)) == bool(IS_READ1(bam)));
+        REQUIRE(bool(counters & (1u << SECOND_COUNTER)) == bool(IS_READ2(bam)));
+        REQUIRE(bool(counters & (1u << FORWARD_MATE_COUNTER)) == !IS_MATE_REVERSE(bam));
+        REQUIRE(bool(counters & (1u << REVERSE_MATE_COUNTER)) == bool(IS_MATE_REVERSE(bam)));
+        REQUIRE(bool(counters & (1u << PAIRED_COUNTER)) == bool(IS_PAIRED(bam)));
+
+        for (size_t counter = 0; counter < FLAG_COUNTER_COUNT; counter++) {
+            expected_totals[counter] += (counters >> counter) & 1;
+        }
+
+        FlagCategory expected_category =
+            IS_QCFAIL(bam) ? QC_FAILED_CATEGORY :
+            !IS_PAIRED(bam) ? UNPAIRED_CATEGORY :
+            IS_UNMAPPED(bam) ? UNMAPPED_CATEGORY :
+            IS_MATE_UNMAPPED(bam) ? MATE_UNMAPPED_CATEGORY :
+            !IS_REVERSE(bam) && !IS_MATE_REVERSE(bam) ? FF_CATEGORY :
+            IS_REVERSE(bam) && IS_MATE_REVERSE(bam) ? RR_CATEGORY :
+            IS_PROPERLYPAIRED(bam) ? PROPERLY_PAIRED_CATEGORY :
+            IMPROPERLY_PAIRED_CATEGORY;
+        REQUIRE(flag_class_category(classify_flag(flag)) == expected_category);
+    }
+
+    SECTION("Counting a run of flags") {
+        unsigned long long int totals[FLAG_COUNTER_COUNT] = {};
+        count_flag_counters(flags.data(), flags.size(), totals);
+        for (size_t counter = 0; counter < FLAG_COUNTER_COUNT; counter++) {
+            REQUIRE(totals[counter] == expected_totals[counter]);
+        }
+
+        // a partial block
+        unsigned long long int partial_totals[FLAG_COUNTER_COUNT] = {};
+        count_flag_counters(flags.data() + 4000, 5, partial_totals);
+        REQUIRE(partial_totals[PAIRED_COUNTER] == 2);
+        REQUIRE(partial_totals[FORWARD_COUNTER] + partial_totals[REVERSE_COUNTER] == 5);
+    }
+}
+
 TEST_CASE("Test bad HTS record") {
     samFile *in;
     bam_hdr_t *header;
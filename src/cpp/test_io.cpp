@@ -1,5 +1,8 @@
 #include <cstdio>
 #include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "catch.hpp"
 
@@ -42,3 +45,30 @@ TEST_CASE("Test gzipped output", "[io/mostream]") {
         REQUIRE_THROWS(mistream("something/not/there.gz"));
     }
 }
+
+
+TEST_CASE("Test spilling name/value pairs", "[io/NameValueSpill]") {
+    // a tiny buffer, so the pairs are spread over several runs
+    NameValueSpill spill(2);
+    spill.add("read3", 1);
+    spill.add("read1", 2);
+    spill.add("read2", 3);
+    spill.add("read1", 4);
+    spill.add("read3", 5);
+
+    std::vector<std::pair<std::string, unsigned long long int>> replayed;
+    spill.replay([&replayed](const std::string& name, unsigned long long int value) {
+        replayed.push_back({name, value});
+    });
+
+    std::vector<std::pair<std::string, unsigned long long int>> expected = {
+        {"read1", 2}, {"read1", 4}, {"read2", 3}, {"read3", 1}, {"read3", 5}
+    };
+    REQUIRE(expected == replayed);
+
+    replayed.clear();
+    spill.replay([&replayed](const std::string& name, unsigned long long int value) {
+        replayed.push_back({name, value});
+    });
+    REQUIRE(replayed.empty());
+}
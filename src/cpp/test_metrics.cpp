@@ -21,6 +21,17 @@ TEST_CASE("MetricsCollector basics", "[metrics/collector]") {
         REQUIRE_FALSE(collector.is_mitochondrial("foo"));
     }
 
+    SECTION("MetricsCollector::classify_references") {
+        collector.classify_references({"chr1", "chrM", "chrX"});
+        REQUIRE(collector.is_autosomal_tid(0));
+        REQUIRE_FALSE(collector.is_mitochondrial_tid(0));
+        REQUIRE(collector.is_mitochondrial_tid(1));
+        REQUIRE_FALSE(collector.is_autosomal_tid(1));
+        REQUIRE_FALSE(collector.is_autosomal_tid(2));
+        REQUIRE_FALSE(collector.is_autosomal_tid(-1));
+        REQUIRE_FALSE(collector.is_mitochondrial_tid(3));
+    }
+
     SECTION("MetricsCollector::configuration_string") {
         std::string expected = "ataqv " + version_string() + "\n\n" +
             "Operating parameters\n" +
@@ -167,6 +178,488 @@ TEST_CASE("Metrics::load_alignments", "[metrics/load_alignments]") {
     REQUIRE(1.28125 == j[0]["metrics"]["short_mononucleosomal_ratio"].get<long double>());
 }
 
+TEST_CASE("Metrics::load_alignments in parallel", "[metrics/load_alignments_in_parallel]") {
+    std::string name("Test collector");
+    std::string alignment_file_name("test.bam");
+    std::string peak_file_name("test.peaks.gz");
+    std::string tss_file_name("hg19.tss.refseq.bed.gz");
+
+    MetricsCollector serial_collector(name, "human", "", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", alignment_file_name, "", "chrM", peak_file_name, tss_file_name, 1000, false, 1, false, false, false, true, false, {"exclude.dac.bed.gz", "exclude.duke.bed.gz"});
+    serial_collector.load_alignments();
+
+    MetricsCollector parallel_collector(name, "human", "", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", alignment_file_name, "", "chrM", peak_file_name, tss_file_name, 1000, false, 4, false, false, false, true, false, {"exclude.dac.bed.gz", "exclude.duke.bed.gz"});
+    parallel_collector.load_alignments();
+
+    REQUIRE(parallel_collector.metrics.size() == serial_collector.metrics.size());
+
+    nlohmann::json serial_json = serial_collector.to_json();
+    nlohmann::json parallel_json = parallel_collector.to_json();
+    for (size_t i = 0; i < serial_json.size(); i++) {
+        REQUIRE(parallel_json[i]["metrics"].dump() == serial_json[i]["metrics"].dump());
+    }
+}
+
+TEST_CASE("Metrics::load_alignments with reader and workers", "[metrics/load_alignments_in_parallel]") {
+    // a name-sorted file can't be read in chunks, so several threads
+    // mean one reader handing records to workers
+    std::string name("Test collector");
+    std::string alignment_file_name("SRR891278.bam");
+    std::string peak_file_name("SRR891278.peaks.gz");
+    std::string tss_file_name("hg19.tss.refseq.bed.gz");
+
+    MetricsCollector serial_collector(name, "human", "", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", alignment_file_name, "", "chrM", peak_file_name, tss_file_name, 1000, false, 1, false, false, false, true, false, {"exclude.dac.bed.gz", "exclude.duke.bed.gz"});
+    serial_collector.load_alignments();
+
+    MetricsCollector parallel_collector(name, "human", "", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", alignment_file_name, "", "chrM", peak_file_name, tss_file_name, 1000, false, 4, false, false, false, true, false, {"exclude.dac.bed.gz", "exclude.duke.bed.gz"});
+    parallel_collector.load_alignments();
+
+    REQUIRE(!parallel_collector.coordinate_sorted);
+    REQUIRE(parallel_collector.metrics.size() == serial_collector.metrics.size());
+
+    nlohmann::json serial_json = serial_collector.to_json();
+    nlohmann::json parallel_json = parallel_collector.to_json();
+    for (size_t i = 0; i < serial_json.size(); i++) {
+        REQUIRE(parallel_json[i]["metrics"].dump() == serial_json[i]["metrics"].dump());
+    }
+}
+
+TEST_CASE("MetricsCollector::merge_state", "[metrics/merge_state]") {
+    std::string name("Test collector");
+    std::string alignment_file_name("test.bam");
+    std::string peak_file_name("test.peaks.gz");
+    std::string tss_file_name("hg19.tss.refseq.bed.gz");
+
+    MetricsCollector collector(name, "human", "", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", alignment_file_name, "", "chrM", peak_file_name, tss_file_name, 1000, false, 1, false, false, false, true, false, {"exclude.dac.bed.gz", "exclude.duke.bed.gz"});
+    collector.load_alignments();
+
+    std::vector<nlohmann::json> states;
+    for (int shard = 1; shard <= 3; shard++) {
+        MetricsCollector shard_collector(name, "human", "", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", alignment_file_name, "", "chrM", peak_file_name, tss_file_name, 1000, false, 1, false, false, false, true, false, {"exclude.dac.bed.gz", "exclude.duke.bed.gz"});
+        shard_collector.shard_index = shard;
+        shard_collector.shard_count = 3;
+        shard_collector.load_alignments();
+        states.push_back(shard_collector.state_to_json());
+    }
+
+    MetricsCollector merged_collector = MetricsCollector::from_state(states[0]);
+    for (auto state = states.rbegin(); state != states.rend(); state++) {
+        merged_collector.merge_state(nlohmann::json::parse(state->dump()));
+    }
+    merged_collector.finalize();
+
+    REQUIRE(merged_collector.metrics.size() == collector.metrics.size());
+
+    nlohmann::json expected_json = collector.to_json();
+    nlohmann::json merged_json = merged_collector.to_json();
+    for (size_t i = 0; i < expected_json.size(); i++) {
+        REQUIRE(merged_json[i]["metrics"].dump() == expected_json[i]["metrics"].dump());
+    }
+
+    SECTION("MetricsCollector::merge_state rejects states collected differently") {
+        nlohmann::json state = states[0];
+        state["collector"]["tss_extension"] = 500;
+        REQUIRE_THROWS_AS(merged_collector.merge_state(state), FileException);
+
+        state = states[0];
+        state["collector"]["nucleus_barcode_tag"] = "CB";
+        REQUIRE_THROWS_AS(merged_collector.merge_state(state), FileException);
+
+        state = states[0];
+        state["collector"]["alignment_filename"] = "other.bam";
+        REQUIRE_THROWS_AS(merged_collector.merge_state(state), FileException);
+    }
+
+    SECTION("MetricsCollector::from_state rejects anything but a shard's state") {
+        REQUIRE_THROWS_AS(MetricsCollector::from_state(expected_json), FileException);
+
+        nlohmann::json state = states[0];
+        state["collector"].erase("metrics_modules");
+        REQUIRE_THROWS_AS(MetricsCollector::from_state(state), FileException);
+
+        state = states[0];
+        state["metrics"][0].erase("counters");
+        REQUIRE_THROWS_AS(merged_collector.merge_state(state), FileException);
+    }
+}
+
+TEST_CASE("Metrics::merge pairs TSS fragments split between chunks", "[metrics/merge_tss_fragments]") {
+    MetricsCollector collector("TSS collector", "human", "", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", "test.bam", "", "chrM", "");
+
+    // one TSS at 1000, extended by 1000 on each side
+    TSSWindow window;
+    window.start = 0;
+    window.end = 2001;
+    window.reach = 2001;
+    collector.tss_windows = {{window}};
+
+    Metrics first(&collector, "first");
+    Metrics second(&collector, "second");
+
+    TSSFragment paired;
+    paired.tid = 0;
+    paired.start = 900;
+    paired.end = 1100;
+
+    TSSFragment lonely;
+    lonely.tid = 0;
+    lonely.start = 950;
+    lonely.end = 1050;
+
+    // the first chunk credited "paired" from its leftmost mate; the
+    // second saw only the rightmost mates
+    // fragments are known by their query name hashes
+    const uint64_t paired_hash = 1;
+    const uint64_t lonely_hash = 2;
+
+    first.tss_fragments_credited.insert(paired_hash);
+    second.tss_fragments_deferred[paired_hash] = paired;
+    second.tss_fragments_deferred[lonely_hash] = lonely;
+
+    first.merge(second);
+    REQUIRE(first.tss_fragments_credited.empty());
+    REQUIRE(first.tss_fragments_deferred.size() == 1);
+
+    first.settle_tss_coverage();
+    REQUIRE(first.tss_fragments_deferred.empty());
+    REQUIRE(first.tss_count == 1);
+    REQUIRE(first.tss_flanking_count == 0);
+}
+
+TEST_CASE("Metrics::add_tss_coverage pairs mates", "[metrics/tss_mates]") {
+    MetricsCollector collector("TSS collector", "human", "", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", "test.bam", "", "chrM", "");
+    collector.classify_references({"chr1"});
+    collector.coordinate_sorted = true;
+
+    // one TSS at 1000, extended by 1000 on each side
+    TSSWindow window;
+    window.start = 0;
+    window.end = 2001;
+    window.reach = 2001;
+    collector.tss_windows = {{window}};
+
+    // fragment A has both mates, B loses its mate, C isn't near the TSS
+    std::string sam(
+        "data:,@SQ\tSN:chr1\tLN:100000\n"
+        "A\t99\tchr1\t951\t60\t10M\t=\t1001\t100\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "B\t99\tchr1\t961\t60\t10M\t=\t1051\t100\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "A\t147\tchr1\t1001\t60\t10M\t=\t951\t-100\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "C\t99\tchr1\t5001\t60\t10M\t=\t5051\t100\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+    );
+    samFile* in = sam_open(sam.c_str(), "r");
+    bam_hdr_t* header = sam_hdr_read(in);
+    bam1_t* record = bam_init1();
+
+    Metrics metrics(&collector, "metrics");
+    metrics.tss_requested = true;
+
+    size_t waiting[] = {1, 2, 1, 0};
+    for (size_t i = 0; sam_read1(in, header, record) >= 0; i++) {
+        metrics.add_tss_coverage(header, record);
+        REQUIRE(metrics.tss_mates.size() == waiting[i]);
+    }
+
+    // each fragment covering the TSS is counted once
+    REQUIRE(metrics.tss_count == 2);
+    REQUIRE(metrics.tss_fragments_credited.empty());
+    REQUIRE(metrics.tss_fragments_deferred.empty());
+
+    bam_destroy1(record);
+    bam_hdr_destroy(header);
+    hts_close(in);
+}
+
+TEST_CASE("Metrics::add_tss_coverage pairs adjacent mates", "[metrics/tss_mates]") {
+    MetricsCollector collector("TSS collector", "human", "", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", "test.bam", "", "chrM", "");
+    collector.classify_references({"chr1"});
+    collector.query_grouped = true;
+
+    TSSWindow window;
+    window.start = 0;
+    window.end = 2001;
+    window.reach = 2001;
+    collector.tss_windows = {{window}};
+
+    // grouped by name: A's rightmost mate comes first, B loses its
+    // mate, and is given up on when C's reads start
+    std::string sam(
+        "data:,@HD\tVN:1.6\tGO:query\n@SQ\tSN:chr1\tLN:100000\n"
+        "A\t147\tchr1\t1001\t60\t10M\t=\t951\t-100\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "A\t99\tchr1\t951\t60\t10M\t=\t1001\t100\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "B\t99\tchr1\t961\t60\t10M\t=\t1051\t100\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "C\t99\tchr1\t5001\t60\t10M\t=\t5051\t100\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+        "C\t147\tchr1\t5051\t60\t10M\t=\t5001\t-100\tAAAAAAAAAA\tJJJJJJJJJJ\n"
+    );
+    samFile* in = sam_open(sam.c_str(), "r");
+    bam_hdr_t* header = sam_hdr_read(in);
+    bam1_t* record = bam_init1();
+
+    Metrics metrics(&collector, "metrics");
+    metrics.tss_requested = true;
+
+    size_t waiting[] = {1, 0, 1, 0, 0};
+    for (size_t i = 0; sam_read1(in, header, record) >= 0; i++) {
+        metrics.add_tss_coverage(header, record);
+        REQUIRE(metrics.tss_mates.size() == waiting[i]);
+        REQUIRE(metrics.tss_mate_expiry.empty());
+    }
+
+    REQUIRE(metrics.tss_count == 2);
+    REQUIRE(metrics.tss_fragments_credited.empty());
+    REQUIRE(metrics.tss_fragments_deferred.empty());
+
+    bam_destroy1(record);
+    bam_hdr_destroy(header);
+    hts_close(in);
+}
+
+TEST_CASE("Metrics::credit_tss_coverage", "[metrics/tss_coverage]") {
+    MetricsCollector collector("TSS collector", "human", "", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", "test.bam", "", "chrM", "", "", 150);
+    collector.classify_references({"chr1"});
+
+    // a forward and a reverse TSS whose windows overlap
+    TSSWindow forward;
+    forward.start = 1000;
+    forward.end = 1301;
+    forward.reach = 1301;
+    TSSWindow reverse;
+    reverse.start = 1200;
+    reverse.end = 1501;
+    reverse.reach = 1501;
+    reverse.reverse = true;
+    collector.tss_windows = {{forward, reverse}};
+
+    std::vector<std::pair<int64_t, int64_t>> fragments = {{900, 1050}, {1100, 1400}, {1290, 1310}, {1450, 1700}, {0, 5000}, {1149, 1151}};
+
+    // count each base the slow way
+    std::map<int, unsigned long long int> expected_coverage;
+    unsigned long long int expected_flanking_count = 0;
+    unsigned long long int expected_tss_count = 0;
+    for (const auto& fragment : fragments) {
+        for (const TSSWindow& window : collector.tss_windows[0]) {
+            for (int64_t pos = std::max(fragment.first, window.start); pos <= std::min(fragment.second, window.end); pos++) {
+                int64_t base = window.reverse ? (window.end - pos) : (pos - window.start);
+                if (base >= 1 && base <= 301) {
+                    expected_coverage[base]++;
+                }
+                if ((base > 0 && base <= 100) || base > 201) {
+                    expected_flanking_count++;
+                }
+                if (base == 151) {
+                    expected_tss_count++;
+                }
+            }
+        }
+    }
+
+    Metrics coverage(&collector, "coverage");
+    coverage.tss_coverage_requested = true;
+    Metrics counts(&collector, "counts");
+    counts.tss_coverage_requested = false;
+    for (const auto& fragment : fragments) {
+        coverage.credit_tss_coverage(0, fragment.first, fragment.second);
+        counts.credit_tss_coverage(0, fragment.first, fragment.second);
+    }
+    coverage.settle_tss_coverage();
+
+    for (int base = 1; base <= 301; base++) {
+        REQUIRE(coverage.tss_coverage[base] == expected_coverage[base]);
+    }
+    REQUIRE(counts.tss_flanking_count == expected_flanking_count);
+    REQUIRE(counts.tss_count == expected_tss_count);
+
+    // a window standing for two TSS is credited twice
+    forward.count = 2;
+    collector.tss_windows = {{forward}};
+    Metrics coalesced(&collector, "coalesced");
+    coalesced.tss_coverage_requested = false;
+    coalesced.credit_tss_coverage(0, 1050, 1250);
+    REQUIRE(coalesced.tss_count == 2);
+    REQUIRE(coalesced.tss_flanking_count == 2 * 100);
+}
+
+TEST_CASE("Histogram", "[metrics/histogram]") {
+    Histogram<4> histogram;
+    REQUIRE(histogram[0] == 0);
+    REQUIRE(histogram.overflow() == 0);
+
+    histogram.allocate();
+    histogram.add(0);
+    histogram.add(3, 2);
+    histogram.add(4);
+    histogram.add(1000);
+
+    REQUIRE(histogram[0] == 1);
+    REQUIRE(histogram[1] == 0);
+    REQUIRE(histogram[3] == 2);
+    REQUIRE(histogram.overflow() == 2);
+    REQUIRE(histogram[Histogram<4>::size] == 2);
+
+    Histogram<4> other;
+    other.allocate();
+    other.add(1);
+    other.set(7, 5);
+    histogram.merge(other);
+
+    REQUIRE(histogram[1] == 1);
+    REQUIRE(histogram.overflow() == 7);
+}
+
+TEST_CASE("Metrics modules", "[metrics/modules]") {
+    REQUIRE(parse_metrics_modules("all") == ALL_METRICS);
+    REQUIRE(parse_metrics_modules("tss") == TSS_METRICS);
+    REQUIRE(parse_metrics_modules("tss,mapq,tss") == (TSS_METRICS | MAPQ_METRICS));
+    REQUIRE_THROWS_AS(parse_metrics_modules("tss,everything"), std::invalid_argument);
+
+    REQUIRE(metrics_module_names(MAPQ_METRICS | IMPROPER_METRICS) == std::vector<std::string>({"mapq", "improper"}));
+    REQUIRE(parse_metrics_modules("fragment-length,mapq,chromosomes,peaks,tss,improper") == ALL_METRICS);
+
+    MetricsCollector collector("Module collector", "human", "", "a collector for unit tests", "a library of brutal tests?", "https://theparkerlab.org", "test.bam", "", "chrM", "", "test.tss.bed.gz");
+    collector.metrics_modules = MAPQ_METRICS;
+    Metrics metrics(&collector, "metrics");
+    REQUIRE(metrics.modules == MAPQ_METRICS);
+    REQUIRE(!metrics.tss_requested);
+
+    nlohmann::json result = metrics.to_json()["metrics"];
+    REQUIRE(result["median_mapq"] == 0);
+    REQUIRE(result["median_fragment_length"].is_null());
+    REQUIRE(result["fragment_length_counts"].is_null());
+    REQUIRE(result["short_mononucleosomal_ratio"].is_null());
+    REQUIRE(!result["mapq_counts"].is_null());
+    REQUIRE(result["reads_with_mate_too_distant"].is_null());
+    REQUIRE(result["maximum_proper_pair_fragment_size"].is_null());
+    REQUIRE(result["max_fraction_reads_from_single_autosome"].is_null());
+}
+
+TEST_CASE("MetricsKeyTable", "[metrics/metrics_key_table]") {
+    MetricsKeyTable table;
+    std::vector<std::string> barcodes;
+    for (int i = 0; i < 1000; i++) {
+        barcodes.push_back("AAACCTG" + std::to_string(i) + "-1");
+    }
+
+    for (size_t i = 0; i < barcodes.size(); i++) {
+        MetricsKey key;
+        key.add("rg1", 3);
+        key.add("-", 1);
+        key.add(barcodes[i].c_str(), barcodes[i].size());
+        REQUIRE(table.find(key) == MetricsKeyTable::npos);
+        REQUIRE(table.insert(key) == i);
+    }
+
+    REQUIRE(table.size() == barcodes.size());
+
+    for (size_t i = 0; i < barcodes.size(); i++) {
+        MetricsKey key;
+        key.add("rg1", 3);
+        key.add("-", 1);
+        key.add(barcodes[i].c_str(), barcodes[i].size());
+        REQUIRE(table.find(key) == i);
+        REQUIRE(table.id(i) == "rg1-" + barcodes[i]);
+    }
+
+    // keys are the IDs they spell, however they're split into pieces
+    MetricsKey key;
+    key.add("rg1-", 4);
+    key.add(barcodes[7].c_str(), barcodes[7].size());
+    REQUIRE(table.find(key) == 7);
+
+    MetricsKey missing;
+    missing.add("rg2", 3);
+    REQUIRE(table.find(missing) == MetricsKeyTable::npos);
+}
+
+TEST_CASE("ProblematicReadWriter", "[metrics/problematic_read_writer]") {
+    std::string sam("data:,@SQ\tSN:chr20\tLN:63025520\nSRR891268.122333488\t83\tchr20\t60087\t60\t50M\t=\t60058\t-79\tAGGAAGGAGAGAGTGAAGGAACTGCCAGGTGACACACTCCCACCATGGAC\tJJJJJJJJJJJJJJJJJIHHGIGIIIJJJJJIIGGIJHHHHHFFFFFCBB\tMD:Z:50\n");
+    samFile* in = sam_open(sam.c_str(), "r");
+    bam_hdr_t* header = sam_hdr_read(in);
+    bam1_t* record = bam_init1();
+    REQUIRE(sam_read1(in, header, record) >= 0);
+    std::string formatted = record_to_string(header, record);
+
+    std::string first_filename = "problematic_read_writer.first.test";
+    std::string second_filename = "problematic_read_writer.second.test.gz";
+    auto first = mostream(first_filename);
+    auto second = mostream(second_filename);
+
+    {
+        // small enough that adding has to wait for the writer
+        ProblematicReadWriter writer(2, 2);
+        for (int i = 0; i < 10; i++) {
+            writer.add(first, "RF", header, record);
+            writer.add(second, "Undiagnosed", "read" + std::to_string(i));
+        }
+        writer.add(first, "Empty");
+        writer.flush();
+
+        // the header can go once the writer's flushed
+        bam_hdr_destroy(header);
+        header = nullptr;
+    }
+
+    std::vector<std::string> first_lines;
+    auto first_in = mistream(first_filename);
+    for (std::string line; std::getline(*first_in, line);) {
+        first_lines.push_back(line);
+    }
+    REQUIRE(first_lines.size() == 11);
+    REQUIRE(first_lines[0] == "RF\t" + formatted);
+    REQUIRE(first_lines[9] == "RF\t" + formatted);
+    REQUIRE(first_lines[10] == "Empty");
+
+    second.reset();
+    std::vector<std::string> second_lines;
+    auto second_in = mistream(second_filename);
+    for (std::string line; std::getline(*second_in, line);) {
+        second_lines.push_back(line);
+    }
+    REQUIRE(second_lines.size() == 10);
+    for (int i = 0; i < 10; i++) {
+        REQUIRE(second_lines[i] == "Undiagnosed\tread" + std::to_string(i));
+    }
+
+    bam_destroy1(record);
+    hts_close(in);
+    std::remove(first_filename.c_str());
+    std::remove(second_filename.c_str());
+}
+
+TEST_CASE("ProblematicReadSample", "[metrics/problematic_read_sample]") {
+    ProblematicReadSample sample(5, 42);
+    int described = 0;
+
+    for (int i = 0; i < 1000; i++) {
+        sample.add("RF", [&described, i] {described++; return "rf" + std::to_string(i);});
+        if (i < 3) {
+            sample.add("Unpaired", [i] {return "unpaired" + std::to_string(i);});
+        }
+    }
+
+    auto categories = sample.list_categories();
+    REQUIRE(categories.size() == 2);
+
+    REQUIRE(categories[0].problem == "RF");
+    REQUIRE(categories[0].count == 1000);
+    REQUIRE(categories[0].examples.size() == 5);
+    // most reads were only counted
+    REQUIRE(described < 100);
+    for (size_t i = 1; i < categories[0].examples.size(); i++) {
+        REQUIRE(categories[0].examples[i - 1].sequence < categories[0].examples[i].sequence);
+    }
+    for (const auto& example : categories[0].examples) {
+        REQUIRE(example.text == "rf" + std::to_string(example.sequence));
+    }
+
+    REQUIRE(categories[1].problem == "Unpaired");
+    REQUIRE(categories[1].count == 3);
+    REQUIRE(categories[1].examples.size() == 3);
+    REQUIRE(categories[1].examples[2].text == "unpaired2");
+
+    ProblematicReadSample counts_only(0, 42);
+    counts_only.add("RR", [] {return std::string("rr");});
+    REQUIRE(counts_only.list_categories()[0].count == 1);
+    REQUIRE(counts_only.list_categories()[0].examples.empty());
+}
+
 TEST_CASE("Metrics::load_alignments errors", "[metrics/load_alignments_errors]") {
     SECTION("MetricsCollector::load_alignments fails without alignment file name") {
         MetricsCollector collector("Broken collector", "human", "", "a collector without an alignment file", "a library of brutal tests?", "https://theparkerlab.org", "", "", "", "");
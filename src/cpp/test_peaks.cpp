@@ -133,6 +133,42 @@ TEST_CASE("Peak HQAA counting", "peaks/hqaa") {
 }
 
 
+TEST_CASE("Peak HQAA counting by reference ID", "[peaks/hqaa_by_tid]") {
+    PeakTree tree;
+
+    Peak peak1("chr1", 100, 200, "peak1");
+    Peak peak2("chr1", 150, 250, "peak2");
+    Peak peak3("chr2", 100, 200, "peak3");
+
+    tree.add(peak1);
+    tree.add(peak2);
+    tree.add(peak3);
+    tree.index_references({"chr2", "chr1", "chr3"});
+
+    tree.record_alignment(Interval(1, 125, 175), true, false);
+    tree.record_alignment(Interval(0, 300, 400), true, true);
+    tree.record_alignment(Interval(2, 125, 175), true, false);
+    tree.record_alignment(Interval(-1, 0, 0), false, false);
+
+    // a copy has to find the peaks in its own tree
+    PeakTree copy = tree;
+    copy.record_alignment(Interval(0, 150, 160), true, false);
+
+    auto peaks = tree.list_peaks();
+    REQUIRE(1 == peaks[0].overlapping_hqaa);
+    REQUIRE(1 == peaks[1].overlapping_hqaa);
+    REQUIRE(0 == peaks[2].overlapping_hqaa);
+    REQUIRE(2 == tree.hqaa_in_peaks);
+    REQUIRE(1 == tree.ppm_in_peaks);
+    REQUIRE(3 == tree.ppm_not_in_peaks);
+    REQUIRE(1 == tree.duplicates_not_in_peaks);
+
+    auto copied_peaks = copy.list_peaks();
+    REQUIRE(1 == copied_peaks[2].overlapping_hqaa);
+    REQUIRE(3 == copy.hqaa_in_peaks);
+}
+
+
 TEST_CASE("PeakTree reference peak counts", "[peaks/referencepeakcounts]") {
     PeakTree tree;
 
@@ -180,3 +216,39 @@ TEST_CASE("ReferencePeakCollection only accepts peaks on the same reference", "[
     REQUIRE_NOTHROW(rpc.add(peak2));
     REQUIRE_THROWS_AS(rpc.add(peak3), std::out_of_range);
 }
+
+
+TEST_CASE("Peak merge", "peaks/merge") {
+    PeakTree tree;
+    PeakTree other;
+
+    Peak peak1("chr1", 100, 200, "peak1");
+    Peak peak2("chr2", 150, 250, "peak2");
+
+    tree.add(peak1);
+    tree.add(peak2);
+    other.add(peak1);
+    other.add(peak2);
+
+    tree.record_alignment(Feature("chr1", 150, 160, "read"), true, false);
+    other.record_alignment(Feature("chr1", 150, 160, "read"), true, true);
+    other.record_alignment(Feature("chr2", 200, 210, "read"), true, false);
+    other.record_alignment(Feature("chr3", 200, 210, "read"), false, false);
+
+    tree.merge(other);
+
+    auto peaks = tree.list_peaks();
+    REQUIRE(2 == peaks[0].overlapping_hqaa);
+    REQUIRE(1 == peaks[1].overlapping_hqaa);
+    REQUIRE(3 == tree.hqaa_in_peaks);
+    REQUIRE(3 == tree.ppm_in_peaks);
+    REQUIRE(1 == tree.ppm_not_in_peaks);
+    REQUIRE(1 == tree.duplicates_in_peaks);
+
+    PeakTree different;
+    different.add(peak1);
+    different.add(peak2);
+    Peak peak3("chr2", 300, 400, "peak3");
+    different.add(peak3);
+    REQUIRE_THROWS_AS(tree.merge(different), std::out_of_range);
+}
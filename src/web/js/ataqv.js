@@ -1228,7 +1228,9 @@ let ataqv = (function() {
             let fragment_length_counts = [];
             for (let experimentID of experimentIDs) {
                 let m = configuration.metrics[experimentID];
-                fragment_length_counts.push(Object.keys(m['fragment_length_counts']).length);
+                if (m['fragment_length_counts']) {
+                    fragment_length_counts.push(Object.keys(m['fragment_length_counts']).length);
+                }
             }
             let maximumInterestingFragmentLength = d3.min(fragment_length_counts);
 
@@ -1253,6 +1255,11 @@ let ataqv = (function() {
                 let experimentID = experimentIDs[e];
                 let experiment = configuration.metrics[experimentID];
 
+                // not measured, because its module was left out
+                if (!experiment.fragment_length_counts) {
+                    continue;
+                }
+
                 result.series[experimentID] = {
                     experimentID: experimentID,
                     library: experiment.library.library || experiment.name,